@@ -60,6 +60,13 @@ int main (int argc, char *argv [])
     bool isCmdRules              = false;
     const char *metrics_pattern = METRICS_PATTERN;
     const char *assets_pattern = ASSETS_PATTERN;
+    const char *lua_vms         = "0";
+    const char *bytecode_cache  = "";
+    const char *alerts_batch    = "0";
+    const char *alerts_batch_delay = "100";
+    const char *eval_workers    = "1";
+    const char *lua_instructions = "1000000";
+    const char *lua_memory      = "16384";
 
     ftylog_setInstance("fty-alert-flexible", FTY_COMMON_LOGGING_DEFAULT_CFG);
 
@@ -118,6 +125,13 @@ int main (int argc, char *argv [])
         if (!isCmdRules){
             rules = s_get (config, "server/rules", rules);
         }
+        lua_vms = s_get (config, "server/lua_vms", lua_vms);
+        bytecode_cache = s_get (config, "server/bytecode_cache", bytecode_cache);
+        alerts_batch = s_get (config, "server/alerts_batch", alerts_batch);
+        alerts_batch_delay = s_get (config, "server/alerts_batch_delay", alerts_batch_delay);
+        eval_workers = s_get (config, "server/eval_workers", eval_workers);
+        lua_instructions = s_get (config, "server/lua_instructions", lua_instructions);
+        lua_memory = s_get (config, "server/lua_memory", lua_memory);
 
         // endpoint
         if (!isCmdEndpoint){
@@ -173,6 +187,11 @@ int main (int argc, char *argv [])
     // Was: zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_LICENSING_ANNOUNCEMENTS, "licensing.expire.*", NULL);
     zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_LICENSING_ANNOUNCEMENTS, ".*", NULL);
 
+    zstr_sendx (server, "LUAVMS", lua_vms, NULL);
+    zstr_sendx (server, "BYTECODE", bytecode_cache, NULL);
+    zstr_sendx (server, "ALERTSBATCH", alerts_batch, alerts_batch_delay, NULL);
+    zstr_sendx (server, "EVALWORKERS", eval_workers, NULL);
+    zstr_sendx (server, "LUABUDGET", lua_instructions, lua_memory, NULL);
     zstr_sendx (server, "LOADRULES", rules, NULL);
 
     log_debug ("fty_alert_flexible - started");
@@ -27,6 +27,9 @@
 */
 
 #include "fty_alert_flexible_classes.h"
+#include "flexible_alert_private.h"
+#include <regex>
+#include <atomic>
 
 #define ANSI_COLOR_WHITE_ON_BLUE  "\x1b[44;97m"
 #define ANSI_COLOR_BOLD    "\x1b[1;39m"
@@ -35,17 +38,45 @@
 #define ANSI_COLOR_CYAN    "\x1b[1;36m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
-//  Structure of our class
-
-struct _flexible_alert_t {
-    zhash_t *rules;
-    zhash_t *assets;
-    zhash_t *metrics;
-    zhash_t *enames;
-    mlm_client_t *mlm;
+// delay (ms) before SHM patterns are derived again after bindings changed
+#define SHM_PATTERNS_DELAY 100
+// above this count of alternatives, configured SHM pattern is used instead
+#define SHM_PATTERNS_MAX_ITEMS 256
+// maximum count of threads loading rules
+#define RULES_LOADERS_MAX 8
+// period (ms) of metric cache expiry
+#define METRICS_EXPIRY_TICK 1000
+// maximum count of threads evaluating SHM metric batches
+#define EVAL_WORKERS_MAX 16
+
+//  Names of METRIC_STREAM_* sources
+static const char *s_metric_streams [METRIC_STREAMS] = {
+    FTY_PROTO_STREAM_METRICS,
+    FTY_PROTO_STREAM_METRICS_SENSOR,
+    FTY_PROTO_STREAM_LICENSING_ANNOUNCEMENTS,
+    "SHM"
 };
 
-typedef struct _flexible_alert_t flexible_alert_t;
+
+//  Stop and join evaluation threads
+static void
+eval_pool_destroy (eval_pool_t **self_p)
+{
+    assert (self_p);
+    eval_pool_t *self = *self_p;
+    if (!self) return;
+    {
+        std::lock_guard<std::mutex> lock (self->mutex);
+        self->stop = true;
+    }
+    self->wake.notify_all ();
+    for (auto &thread : self->threads)
+        thread.join ();
+    for (eval_job_t &job : self->jobs)
+        zstr_free (&job.message_heap);
+    delete self;
+    *self_p = NULL;
+}
 
 static void rule_freefn (void *rule)
 {
@@ -63,22 +94,261 @@ static void asset_freefn (void *asset)
     }
 }
 
-void ftymsg_freefn (void *ptr)
+//  --------------------------------------------------------------------------
+//  Metric cache
+
+#define METRIC_CACHE_MIN 64
+
+//  FNV-1a of topic, 0 and 1 are reserved for free and deleted slots
+static uint64_t
+s_topic_hash (const char *topic)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *topic; topic++) {
+        hash ^= (unsigned char) *topic;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash < 2 ? hash + 2 : hash;
+}
+
+static const char *
+cached_metric_topic (const cached_metric_t *self)
+{
+    return self->topic_heap ? self->topic_heap : self->topic_buf;
+}
+
+static const char *
+cached_metric_value (const cached_metric_t *self)
+{
+    return self->value_heap ? self->value_heap : self->value_buf;
+}
+
+//  Returns true if value did not fit in the slot and was allocated
+static bool
+cached_metric_set_value (cached_metric_t *self, const char *value)
+{
+    zstr_free (&self->value_heap);
+    size_t len = strlen (value);
+    if (len < CACHED_METRIC_INLINE) {
+        memcpy (self->value_buf, value, len + 1);
+        return false;
+    }
+    self->value_heap = strdup (value);
+    return true;
+}
+
+static metric_cache_t *
+metric_cache_new (void)
+{
+    metric_cache_t *self = (metric_cache_t *) zmalloc (sizeof (metric_cache_t));
+    assert (self);
+    return self;
+}
+
+static void
+metric_cache_destroy (metric_cache_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        metric_cache_t *self = *self_p;
+        for (size_t i = 0; i < self->capacity; i++) {
+            zstr_free (&self->slots [i].topic_heap);
+            zstr_free (&self->slots [i].value_heap);
+        }
+        free (self->slots);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Slot holding topic, or the slot where it is to be inserted
+static cached_metric_t *
+s_metric_cache_slot (metric_cache_t *self, const char *topic, uint64_t hash)
+{
+    size_t mask = self->capacity - 1;
+    cached_metric_t *deleted = NULL;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        cached_metric_t *slot = &self->slots [i];
+        if (slot->hash == 0)
+            return deleted ? deleted : slot;
+        if (slot->hash == 1) {
+            if (!deleted)
+                deleted = slot;
+        }
+        else
+        if (slot->hash == hash && streq (cached_metric_topic (slot), topic))
+            return slot;
+    }
+}
+
+static cached_metric_t *
+metric_cache_lookup (metric_cache_t *self, const char *topic)
+{
+    if (self->capacity == 0)
+        return NULL;
+    cached_metric_t *slot = s_metric_cache_slot (self, topic, s_topic_hash (topic));
+    return slot->hash > 1 ? slot : NULL;
+}
+
+//  Move cached metrics into a new table, dropping deleted slots
+static void
+s_metric_cache_rebuild (metric_cache_t *self, size_t capacity)
+{
+    cached_metric_t *slots = self->slots;
+    size_t old_capacity = self->capacity;
+    self->slots = (cached_metric_t *) zmalloc (capacity * sizeof (cached_metric_t));
+    assert (self->slots);
+    self->capacity = capacity;
+    self->used = self->size;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (slots [i].hash > 1)
+            *s_metric_cache_slot (self, cached_metric_topic (&slots [i]), slots [i].hash) = slots [i];
+    }
+    free (slots);
+}
+
+//  Add topic, which must not be cached yet. Returns its zeroed slot.
+//  Sets allocated when the table was rebuilt or the topic did not fit in
+//  the slot.
+static cached_metric_t *
+metric_cache_insert (metric_cache_t *self, const char *topic, bool *allocated)
+{
+    *allocated = false;
+    // keep a quarter of slots free, so probe sequences stay short
+    if ((self->used + 1) * 4 > self->capacity * 3) {
+        size_t capacity = self->capacity ? self->capacity : METRIC_CACHE_MIN;
+        // grow when half full of metrics, otherwise just drop deleted slots
+        if ((self->size + 1) * 2 > capacity)
+            capacity *= 2;
+        s_metric_cache_rebuild (self, capacity);
+        *allocated = true;
+    }
+    uint64_t hash = s_topic_hash (topic);
+    cached_metric_t *slot = s_metric_cache_slot (self, topic, hash);
+    assert (slot->hash < 2);
+    if (slot->hash == 0)
+        self->used++;
+    self->size++;
+    slot->hash = hash;
+    slot->time = 0;
+    slot->ttl = 0;
+    slot->value_buf [0] = 0;
+    size_t len = strlen (topic);
+    if (len < CACHED_METRIC_TOPIC)
+        memcpy (slot->topic_buf, topic, len + 1);
+    else {
+        slot->topic_heap = strdup (topic);
+        *allocated = true;
+    }
+    return slot;
+}
+
+static void
+metric_cache_delete (metric_cache_t *self, cached_metric_t *slot)
+{
+    zstr_free (&slot->topic_heap);
+    zstr_free (&slot->value_heap);
+    self->size--;
+    // no probe sequence continues past a free slot, so this one can be freed too
+    cached_metric_t *next = &self->slots [(slot - self->slots + 1) & (self->capacity - 1)];
+    if (next->hash == 0) {
+        slot->hash = 0;
+        self->used--;
+    }
+    else
+        slot->hash = 1;
+}
+
+//  Asset attributes rules are matched against
+
+typedef struct {
+    char *ename;                // user friendly name, NULL if unknown
+    char *model;
+    char *device_part;
+    char *type;
+    char *subtype;
+    zlist_t *groups;
+} asset_info_t;
+
+static asset_info_t *
+asset_info_new (fty_proto_t *ftymsg)
+{
+    asset_info_t *self = (asset_info_t *) zmalloc (sizeof (asset_info_t));
+    const char *ename = fty_proto_ext_string (ftymsg, "name", NULL);
+    self->ename = ename ? strdup (ename) : NULL;
+    self->model = strdup (fty_proto_ext_string (ftymsg, FTY_PROTO_ASSET_EXT_MODEL, ""));
+    self->device_part = strdup (fty_proto_ext_string (ftymsg, FTY_PROTO_ASSET_EXT_DEVICE_PART, ""));
+    self->type = strdup (fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_AUX_TYPE, ""));
+    self->subtype = strdup (fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_AUX_SUBTYPE, ""));
+    self->groups = zlist_new ();
+    zlist_autofree (self->groups);
+    zhash_t *ext = fty_proto_ext (ftymsg);
+    const char *group = ext ? (const char *) zhash_first (ext) : NULL;
+    for (; group; group = (const char *) zhash_next (ext)) {
+        if (strncmp ("group.", zhash_cursor (ext), 6) == 0)
+            zlist_append (self->groups, (void *) group);
+    }
+    return self;
+}
+
+static void asset_info_freefn (void *ptr)
+{
+    if (!ptr) return;
+    asset_info_t *self = (asset_info_t *) ptr;
+    zstr_free (&self->ename);
+    zstr_free (&self->model);
+    zstr_free (&self->device_part);
+    zstr_free (&self->type);
+    zstr_free (&self->subtype);
+    zlist_destroy (&self->groups);
+    free (self);
+}
+
+//  Last alert published for a rule and asset
+
+typedef struct {
+    int result;
+    char *message;
+    int64_t time;               // when it was published (monotonic ms)
+} alert_state_t;
+
+static void alert_state_freefn (void *ptr)
 {
     if (!ptr) return;
-    fty_proto_t *fty = (fty_proto_t *)ptr;
-    fty_proto_destroy (&fty);
+    alert_state_t *self = (alert_state_t *) ptr;
+    zstr_free (&self->message);
+    free (self);
 }
 
-static void ename_freefn (void *ename)
+//  Alert waiting to be published in batching mode
+
+typedef struct {
+    char *topic;
+    zmsg_t *msg;
+} pending_alert_t;
+
+static void pending_alert_destroy (pending_alert_t **self_p)
 {
-    if (ename) free (ename);
+    if (!self_p || !*self_p) return;
+    pending_alert_t *self = *self_p;
+    zstr_free (&self->topic);
+    zmsg_destroy (&self->msg);
+    free (self);
+    *self_p = NULL;
+}
+
+static void metric_rules_freefn (void *rules)
+{
+    if (rules) {
+        zlist_t *self = (zlist_t *) rules;
+        zlist_destroy (&self);
+    }
 }
 
 //  --------------------------------------------------------------------------
 //  Create a new flexible_alert
 
-static flexible_alert_t *
+flexible_alert_t *
 flexible_alert_new (void)
 {
     flexible_alert_t *self = (flexible_alert_t *) zmalloc (sizeof (flexible_alert_t));
@@ -86,9 +356,15 @@ flexible_alert_new (void)
     //  Initialize class properties here
     self->rules = zhash_new ();
     self->assets = zhash_new ();
-    self->metrics = zhash_new ();
-    self->enames = zhash_new ();
-    zhash_autofree (self->enames);
+    self->metrics = metric_cache_new ();
+    self->asset_infos = zhash_new ();
+    self->metric_rules = zhash_new ();
+    self->match_rules = zhash_new ();
+    self->alerts = zhash_new ();
+    self->alerts_pending = zlist_new ();
+    self->alerts_pending_idx = zhash_new ();
+    self->eval_workers = 1;
+    self->metrics_expiry = new metric_expiry_queue_t ();
     self->mlm = mlm_client_new ();
     return self;
 }
@@ -96,17 +372,31 @@ flexible_alert_new (void)
 //  --------------------------------------------------------------------------
 //  Destroy the flexible_alert
 
-static void
+void
 flexible_alert_destroy (flexible_alert_t **self_p)
 {
     assert (self_p);
     if (*self_p) {
         flexible_alert_t *self = *self_p;
         //  Free class properties here
+        eval_pool_destroy (&self->eval_pool);
         zhash_destroy (&self->rules);
         zhash_destroy (&self->assets);
-        zhash_destroy (&self->metrics);
-        zhash_destroy (&self->enames);
+        metric_cache_destroy (&self->metrics);
+        zhash_destroy (&self->asset_infos);
+        zhash_destroy (&self->metric_rules);
+        zhash_destroy (&self->match_rules);
+        zhash_destroy (&self->alerts);
+        pending_alert_t *pending = (pending_alert_t *) zlist_first (self->alerts_pending);
+        for (; pending; pending = (pending_alert_t *) zlist_next (self->alerts_pending))
+            pending_alert_destroy (&pending);
+        zlist_destroy (&self->alerts_pending);
+        zhash_destroy (&self->alerts_pending_idx);
+        delete self->metrics_expiry;
+        zstr_free (&self->shm_assets_pattern);
+        zstr_free (&self->shm_metrics_pattern);
+        zstr_free (&self->shm_assets_derived);
+        zstr_free (&self->shm_metrics_derived);
         mlm_client_destroy (&self->mlm);
         //  Free object itself
         free (self);
@@ -135,13 +425,16 @@ flexible_alert_load_one_rule (flexible_alert_t *self, const char *fullpath)
 
 //  --------------------------------------------------------------------------
 //  Load all rules in directory. Rule MUST have ".rule" extension.
+//  Files are read and parsed on a pool of worker threads, rules are then
+//  inserted at once in the actor thread.
 
-static void
+void
 flexible_alert_load_rules (flexible_alert_t *self, const char *path)
 {
     if (!self || !path) return;
 
     log_info ("reading rules from dir '%s'", path);
+    int64_t start = zclock_usecs ();
 
     DIR *dir = opendir(path);
     if (!dir) {
@@ -149,6 +442,7 @@ flexible_alert_load_rules (flexible_alert_t *self, const char *path)
         return;
     }
 
+    std::vector<std::string> files;
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
         log_trace ("checking dir entry %s type %i", entry -> d_name, entry -> d_type);
@@ -157,14 +451,479 @@ flexible_alert_load_rules (flexible_alert_t *self, const char *path)
             int l = strlen (entry -> d_name);
             if ( l > 5 && streq (&(entry -> d_name[l - 5]), ".rule")) {
                 // .rule file (json payload)
-                char* fullpath = NULL;
-                asprintf (&fullpath, "%s/%s", path, entry -> d_name);
-                flexible_alert_load_one_rule (self, fullpath);
-                zstr_free(&fullpath);
+                files.push_back (std::string (path) + "/" + entry -> d_name);
             }
         }
     }
     closedir(dir);
+
+    std::vector<rule_t *> rules (files.size (), NULL);
+    std::vector<int64_t> usecs (files.size (), 0);
+    std::atomic<size_t> next (0);
+    auto worker = [&] () {
+        size_t i;
+        while ((i = next++) < files.size ()) {
+            int64_t t = zclock_usecs ();
+            rule_t *rule = rule_new ();
+            int r = rule_load (rule, files[i].c_str ());
+            if (r != 0) {
+                log_error ("failed to load rule '%s' (r: %d)", files[i].c_str (), r);
+                rule_destroy (&rule);
+            }
+            rules[i] = rule;
+            usecs[i] = zclock_usecs () - t;
+        }
+    };
+
+    size_t count = std::min<size_t> (std::max (std::thread::hardware_concurrency (), 1u), RULES_LOADERS_MAX);
+    count = std::min (count, files.size ());
+    std::vector<std::thread> loaders;
+    for (size_t i = 1; i < count; i++)
+        loaders.emplace_back (worker);
+    worker ();
+    for (auto &loader : loaders)
+        loader.join ();
+
+    size_t loaded = 0;
+    for (size_t i = 0; i < files.size (); i++) {
+        if (!rules[i]) continue;
+        log_info ("rule %s loaded (%lld us)", files[i].c_str (), (long long) usecs[i]);
+        zhash_update (self->rules, rule_name (rules[i]), rules[i]);
+        zhash_freefn (self->rules, rule_name (rules[i]), rule_freefn);
+        loaded++;
+    }
+    log_info ("%zu/%zu rules loaded from '%s' by %zu threads in %lld us",
+        loaded, files.size (), path, std::max<size_t> (count, 1), (long long) (zclock_usecs () - start));
+}
+
+//  --------------------------------------------------------------------------
+//  Ask SHM polling actor to deliver all metrics again on its next poll.
+//  Called whenever rules or asset bindings change, as metrics which did not
+//  change in SHM may now be consumed by other rules. Only one request is
+//  in flight at a time, a new one is sent once the complete batch arrives.
+
+static void
+flexible_alert_shm_resync_send (flexible_alert_t *self)
+{
+    if (!self->metric_polling || self->shm_resync_pending)
+        return;
+    zstr_send (self->metric_polling, "RESYNC");
+    self->shm_resync = self->shm_changes;
+    self->shm_resync_pending = true;
+}
+
+static void
+flexible_alert_shm_resync (flexible_alert_t *self)
+{
+    self->shm_changes++;
+    flexible_alert_shm_resync_send (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Metric index maintenance. For every asset with rules, each "quantity@asset"
+//  topic used by one of those rules maps to the list of rules consuming it.
+
+static void
+flexible_alert_index_asset (flexible_alert_t *self, const char *assetname, zlist_t *functions_for_asset)
+{
+    if (!functions_for_asset) return;
+
+    char *func = (char *) zlist_first (functions_for_asset);
+    for (; func; func = (char *) zlist_next (functions_for_asset)) {
+        rule_t *rule = (rule_t *) zhash_lookup (self->rules, func);
+        if (!rule) continue;
+
+        const char *metric = rule_metric_first (rule);
+        while (metric) {
+            char *topic = NULL;
+            asprintf (&topic, "%s@%s", metric, assetname);
+            zlist_t *rules = (zlist_t *) zhash_lookup (self->metric_rules, topic);
+            if (!rules) {
+                rules = zlist_new ();
+                zhash_insert (self->metric_rules, topic, rules);
+                zhash_freefn (self->metric_rules, topic, metric_rules_freefn);
+            }
+            if (!zlist_exists (rules, rule))
+                zlist_append (rules, rule);
+            zstr_free (&topic);
+            metric = rule_metric_next (rule);
+        }
+    }
+}
+
+static void
+flexible_alert_unindex_asset (flexible_alert_t *self, const char *assetname)
+{
+    zlist_t *functions_for_asset = (zlist_t *) zhash_lookup (self->assets, assetname);
+    if (!functions_for_asset) return;
+
+    char *func = (char *) zlist_first (functions_for_asset);
+    for (; func; func = (char *) zlist_next (functions_for_asset)) {
+        rule_t *rule = (rule_t *) zhash_lookup (self->rules, func);
+        if (!rule) continue;
+
+        const char *metric = rule_metric_first (rule);
+        while (metric) {
+            char *topic = NULL;
+            asprintf (&topic, "%s@%s", metric, assetname);
+            zlist_t *rules = (zlist_t *) zhash_lookup (self->metric_rules, topic);
+            if (rules) {
+                zlist_remove (rules, rule);
+                if (zlist_size (rules) == 0)
+                    zhash_delete (self->metric_rules, topic);
+            }
+            zstr_free (&topic);
+            metric = rule_metric_next (rule);
+        }
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Asset match index. Every asset name, group, model and type listed by
+//  some rule maps to the list of those rules, so that rules matching an
+//  asset are found by a few lookups. Metrics are indexed too, for LIST.
+
+static void
+s_match_index_add (zhash_t *index, const char *prefix, const char *value, rule_t *rule)
+{
+    char key[512];
+    snprintf (key, sizeof (key), "%s:%s", prefix, value);
+    zlist_t *rules = (zlist_t *) zhash_lookup (index, key);
+    if (!rules) {
+        rules = zlist_new ();
+        zhash_insert (index, key, rules);
+        zhash_freefn (index, key, metric_rules_freefn);
+    }
+    if (!zlist_exists (rules, rule))
+        zlist_append (rules, rule);
+}
+
+static void
+flexible_alert_index_rules (flexible_alert_t *self)
+{
+    zhash_destroy (&self->match_rules);
+    self->match_rules = zhash_new ();
+
+    rule_t *rule = (rule_t *) zhash_first (self->rules);
+    for (; rule; rule = (rule_t *) zhash_next (self->rules)) {
+        const char *item;
+        for (item = rule_asset_first (rule); item; item = rule_asset_next (rule))
+            s_match_index_add (self->match_rules, "a", item, rule);
+        for (item = rule_group_first (rule); item; item = rule_group_next (rule))
+            s_match_index_add (self->match_rules, "g", item, rule);
+        for (item = rule_model_first (rule); item; item = rule_model_next (rule))
+            s_match_index_add (self->match_rules, "m", item, rule);
+        for (item = rule_type_first (rule); item; item = rule_type_next (rule))
+            s_match_index_add (self->match_rules, "t", item, rule);
+        for (item = rule_metric_first (rule); item; item = rule_metric_next (rule))
+            s_match_index_add (self->match_rules, "q", item, rule);
+    }
+}
+
+//  Append rules indexed under prefix:value to candidates, without duplicates
+static void
+s_match_candidates (zhash_t *index, const char *prefix, const char *value, zlist_t *candidates)
+{
+    if (!value || streq (value, "")) return;
+    char key[512];
+    snprintf (key, sizeof (key), "%s:%s", prefix, value);
+    zlist_t *rules = (zlist_t *) zhash_lookup (index, key);
+    if (!rules) return;
+    rule_t *rule = (rule_t *) zlist_first (rules);
+    for (; rule; rule = (rule_t *) zlist_next (rules)) {
+        if (!zlist_exists (candidates, rule))
+            zlist_append (candidates, rule);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Function returns true if rule should be evaluated for particular asset.
+//  This is decided by asset name (json "assets": []) or group (json "groups":[])
+
+static int
+is_rule_for_this_asset (rule_t *rule, const char *assetname, asset_info_t *info)
+{
+    if (!rule || !assetname || !info) return 0;
+
+    if (streq (info->subtype, "sensorgpio") )
+    {
+        if (rule_asset_exists (rule, assetname) &&
+            rule_model_exists (rule, info->model) )
+            return 1;
+        else
+            return 0;
+    }
+
+    if (rule_asset_exists (rule, assetname))
+        return 1;
+
+    const char *group = (const char *) zlist_first (info->groups);
+    for (; group; group = (const char *) zlist_next (info->groups)) {
+        if (rule_group_exists (rule, group))
+            return 1;
+    }
+
+    if (rule_model_exists (rule, info->model))
+        return 1;
+    if (rule_model_exists (rule, info->device_part))
+        return 1;
+
+    if (rule_type_exists (rule, info->type))
+        return 1;
+    if (rule_type_exists (rule, info->subtype))
+        return 1;
+
+    return 0;
+}
+
+static int
+s_string_compare (void *item1, void *item2)
+{
+    return strcmp ((const char *) item1, (const char *) item2);
+}
+
+//  Returns sorted list of names of rules valid for the asset
+static zlist_t *
+flexible_alert_match_asset (flexible_alert_t *self, const char *assetname, asset_info_t *info)
+{
+    zlist_t *functions_for_asset = zlist_new ();
+    zlist_autofree (functions_for_asset);
+
+    // only rules listing one of asset attributes can match it
+    zlist_t *candidates = zlist_new ();
+    s_match_candidates (self->match_rules, "a", assetname, candidates);
+    const char *group = (const char *) zlist_first (info->groups);
+    for (; group; group = (const char *) zlist_next (info->groups))
+        s_match_candidates (self->match_rules, "g", group, candidates);
+    s_match_candidates (self->match_rules, "m", info->model, candidates);
+    s_match_candidates (self->match_rules, "m", info->device_part, candidates);
+    s_match_candidates (self->match_rules, "t", info->type, candidates);
+    s_match_candidates (self->match_rules, "t", info->subtype, candidates);
+
+    rule_t *rule = (rule_t *) zlist_first (candidates);
+    for (; rule; rule = (rule_t *) zlist_next (candidates)) {
+        if (is_rule_for_this_asset (rule, assetname, info)) {
+            zlist_append (functions_for_asset, (char *)rule_name (rule));
+            log_debug ("rule '%s' is valid for '%s'", rule_name (rule), assetname);
+        }
+    }
+    zlist_destroy (&candidates);
+    // stable order, whatever attribute matched first
+    zlist_sort (functions_for_asset, s_string_compare);
+    return functions_for_asset;
+}
+
+//  --------------------------------------------------------------------------
+//  Rebuild the whole metric index. Must be called whenever rules are added,
+//  replaced or deleted, as the index holds rule_t pointers. Every known
+//  asset is bound again to the rules valid for it.
+
+void
+flexible_alert_reindex (flexible_alert_t *self)
+{
+    flexible_alert_index_rules (self);
+
+    asset_info_t *info = (asset_info_t *) zhash_first (self->asset_infos);
+    for (; info; info = (asset_info_t *) zhash_next (self->asset_infos)) {
+        const char *assetname = zhash_cursor (self->asset_infos);
+        zlist_t *functions_for_asset = flexible_alert_match_asset (self, assetname, info);
+        if (zlist_size (functions_for_asset) == 0) {
+            zhash_delete (self->assets, assetname);
+            zlist_destroy (&functions_for_asset);
+            continue;
+        }
+        zhash_update (self->assets, assetname, functions_for_asset);
+        zhash_freefn (self->assets, assetname, asset_freefn);
+    }
+
+    zhash_destroy (&self->metric_rules);
+    self->metric_rules = zhash_new ();
+
+    zlist_t *functions_for_asset = (zlist_t *) zhash_first (self->assets);
+    while (functions_for_asset) {
+        flexible_alert_index_asset (self, zhash_cursor (self->assets), functions_for_asset);
+        functions_for_asset = (zlist_t *) zhash_next (self->assets);
+    }
+    log_debug ("metric index rebuilt (%zu topics)", zhash_size (self->metric_rules));
+    // rules changed, publish current state of every alert again
+    zhash_purge (self->alerts);
+    self->shm_patterns_dirty = true;
+    flexible_alert_shm_resync (self);
+}
+
+//  --------------------------------------------------------------------------
+//  SHM pattern derivation. Both patterns are built as an alternation of the
+//  asset names with bound rules and the quantities these rules consume,
+//  restricted to what the configured patterns accept. Quantities may carry
+//  a suffix in SHM (see ext-port handling in flexible_alert_handle_metric).
+
+static void
+s_regex_escape (std::string &out, const char *item)
+{
+    for (const char *c = item; *c; c++) {
+        if (strchr ("\\^$.|?*+()[]{}", *c))
+            out += '\\';
+        out += *c;
+    }
+}
+
+//  Returns newly allocated "^(item1|item2|...)<suffix>$", or "" when empty
+static char *
+s_items_pattern (zhashx_t *items, const char *suffix)
+{
+    if (zhashx_size (items) == 0)
+        return strdup ("");
+
+    std::string pattern = "^(";
+    zlistx_t *keys = zhashx_keys (items);
+    zlistx_sort (keys);
+    const char *item = (const char *) zlistx_first (keys);
+    for (bool first = true; item; item = (const char *) zlistx_next (keys), first = false) {
+        if (!first)
+            pattern += '|';
+        s_regex_escape (pattern, item);
+    }
+    zlistx_destroy (&keys);
+    pattern += ')';
+    pattern += suffix;
+    pattern += '$';
+    return strdup (pattern.c_str ());
+}
+
+//  Compile configured pattern, false if it is not a valid regex
+static bool
+s_pattern_compile (const char *pattern, std::regex &regex)
+{
+    try {
+        regex.assign (pattern);
+        return true;
+    }
+    catch (const std::regex_error &e) {
+        log_warning ("invalid SHM pattern '%s' (%s)", pattern, e.what ());
+        return false;
+    }
+}
+
+//  Assets come from the asset bindings (asset name -> list of rule names),
+//  metrics from the rules bound to them. Each dimension falls back to the configured pattern when it is
+//  invalid or gives too many alternatives.
+static void
+flexible_alert_shm_patterns_derive (flexible_alert_t *self, char **assets_p, char **metrics_p)
+{
+    std::regex assets_regex, metrics_regex;
+    bool assets_valid = s_pattern_compile (self->shm_assets_pattern, assets_regex);
+    bool metrics_valid = s_pattern_compile (self->shm_metrics_pattern, metrics_regex);
+    zhashx_t *assets = zhashx_new ();
+    zhashx_t *metrics = zhashx_new ();
+
+    zlist_t *names = (zlist_t *) zhash_first (self->assets);
+    for (; names && (assets_valid || metrics_valid); names = (zlist_t *) zhash_next (self->assets)) {
+        const char *assetname = zhash_cursor (self->assets);
+        bool consumed = false;
+        const char *name = (const char *) zlist_first (names);
+        for (; name; name = (const char *) zlist_next (names)) {
+            rule_t *rule = (rule_t *) zhash_lookup (self->rules, name);
+            if (!rule) continue;
+            const char *metric = rule_metric_first (rule);
+            for (; metric; metric = rule_metric_next (rule)) {
+                consumed = true;
+                if (metrics_valid && !zhashx_lookup (metrics, metric) && std::regex_match (metric, metrics_regex))
+                    zhashx_insert (metrics, metric, (void *) "");
+            }
+        }
+        if (assets_valid && consumed && std::regex_match (assetname, assets_regex))
+            zhashx_insert (assets, assetname, (void *) "");
+    }
+
+    if (!assets_valid || zhashx_size (assets) > SHM_PATTERNS_MAX_ITEMS)
+        *assets_p = strdup (self->shm_assets_pattern);
+    else
+        *assets_p = s_items_pattern (assets, "");
+    if (!metrics_valid || zhashx_size (metrics) > SHM_PATTERNS_MAX_ITEMS)
+        *metrics_p = strdup (self->shm_metrics_pattern);
+    else
+        *metrics_p = s_items_pattern (metrics, "(\\..*)?");
+
+    zhashx_destroy (&assets);
+    zhashx_destroy (&metrics);
+}
+
+//  --------------------------------------------------------------------------
+//  Recompute SHM patterns from the asset bindings and hand them over to the
+//  SHM polling actor when they differ from the ones it already uses.
+
+void
+flexible_alert_shm_patterns (flexible_alert_t *self)
+{
+    self->shm_patterns_dirty = false;
+    self->shm_patterns_time = zclock_mono ();
+    if (!self->shm_assets_pattern || !self->shm_metrics_pattern)
+        return;
+
+    char *assets = NULL;
+    char *metrics = NULL;
+    flexible_alert_shm_patterns_derive (self, &assets, &metrics);
+
+    if (self->shm_assets_derived && streq (self->shm_assets_derived, assets) &&
+        self->shm_metrics_derived && streq (self->shm_metrics_derived, metrics)) {
+        zstr_free (&assets);
+        zstr_free (&metrics);
+        return;
+    }
+
+    log_info ("SHM patterns derived from rules (assets: %s, metrics: %s)", assets, metrics);
+    zstr_free (&self->shm_assets_derived);
+    zstr_free (&self->shm_metrics_derived);
+    self->shm_assets_derived = assets;
+    self->shm_metrics_derived = metrics;
+    if (self->metric_polling)
+        zstr_sendx (self->metric_polling, "PATTERNS", assets, metrics, NULL);
+}
+
+//  --------------------------------------------------------------------------
+//  Publish all pending alerts of batching mode
+
+static void
+flexible_alert_flush_alerts (flexible_alert_t *self)
+{
+    size_t count = zlist_size (self->alerts_pending);
+    if (count == 0) return;
+
+    int64_t start = zclock_usecs ();
+    pending_alert_t *pending = (pending_alert_t *) zlist_pop (self->alerts_pending);
+    while (pending) {
+        mlm_client_send (self->mlm, pending->topic, &pending->msg);
+        self->alerts_published++;
+        pending_alert_destroy (&pending);
+        pending = (pending_alert_t *) zlist_pop (self->alerts_pending);
+    }
+    zhash_purge (self->alerts_pending_idx);
+    log_debug ("flushed %zu alerts in %lld us", count, (long long) (zclock_usecs () - start));
+}
+
+//  Queue alert for next flush. Alert still pending for the same rule and
+//  asset is replaced, only the latest state matters.
+static void
+flexible_alert_queue_alert (flexible_alert_t *self, const char *key, const char *topic, zmsg_t **alert_p)
+{
+    pending_alert_t *pending = (pending_alert_t *) zhash_lookup (self->alerts_pending_idx, key);
+    if (pending) {
+        zstr_free (&pending->topic);
+        zmsg_destroy (&pending->msg);
+    }
+    else {
+        pending = (pending_alert_t *) zmalloc (sizeof (pending_alert_t));
+        zlist_append (self->alerts_pending, pending);
+        zhash_insert (self->alerts_pending_idx, key, pending);
+    }
+    pending->topic = strdup (topic);
+    pending->msg = *alert_p;
+    *alert_p = NULL;
+
+    if (zlist_size (self->alerts_pending) == 1)
+        self->alerts_deadline = zclock_mono () + self->alerts_batch_delay;
+    if ((int) zlist_size (self->alerts_pending) >= self->alerts_batch)
+        flexible_alert_flush_alerts (self);
 }
 
 static void
@@ -175,8 +934,10 @@ flexible_alert_send_alert (flexible_alert_t *self, rule_t *rule, const char *ass
     if (result == -2 || result == 2) severity = (char*) "CRITICAL";
 
     // topic
-    char *topic = NULL;
-    asprintf (&topic, "%s/%s@%s", rule_name (rule), severity, asset);
+    char topic[512];
+    snprintf (topic, sizeof (topic), "%s/%s@%s", rule_name (rule), severity, asset);
+    char key[512];
+    snprintf (key, sizeof (key), "%s@%s", rule_name (rule), asset);
 
     // Logical asset if specified
     const char *la = rule_logical_asset (rule);
@@ -205,86 +966,181 @@ flexible_alert_send_alert (flexible_alert_t *self, rule_t *rule, const char *ass
             rule_name(rule), asset, severity, result);
     }
 
-    mlm_client_send (self -> mlm, topic, &alert);
+    if (self->alerts_batch > 0)
+        flexible_alert_queue_alert (self, key, topic, &alert);
+    else {
+        mlm_client_send (self -> mlm, topic, &alert);
+        self->alerts_published++;
+    }
 
-    zstr_free (&topic);
     zmsg_destroy (&alert);
 }
 
+//  --------------------------------------------------------------------------
+//  Returns true if alert has to be published: its result or message differ
+//  from the last published one, or half of its ttl elapsed since then.
+
+static bool
+flexible_alert_alert_changed (flexible_alert_t *self, rule_t *rule, const char *asset, int result, const char *message, int ttl)
+{
+    char key[512];
+    snprintf (key, sizeof (key), "%s@%s", rule_name (rule), asset);
+    if (!message) message = "";
+    int64_t now = zclock_mono ();
+
+    alert_state_t *state = (alert_state_t *) zhash_lookup (self->alerts, key);
+    if (state && state->result == result && streq (state->message, message) &&
+        now - state->time < (int64_t) ttl * 1000 / 2) {
+        self->alerts_suppressed++;
+        return false;
+    }
+
+    if (!state) {
+        state = (alert_state_t *) zmalloc (sizeof (alert_state_t));
+        zhash_insert (self->alerts, key, state);
+        zhash_freefn (self->alerts, key, alert_state_freefn);
+    }
+    if (!state->message || !streq (state->message, message)) {
+        zstr_free (&state->message);
+        state->message = strdup (message);
+    }
+    state->result = result;
+    state->time = now;
+    return true;
+}
+
+//  Forget last published alerts of deleted rule or asset, so that they are
+//  published again if the rule or asset comes back. One of rule and asset
+//  is NULL.
+
 static void
-flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *assetname, const char *ename)
+flexible_alert_forget_alerts (flexible_alert_t *self, const char *rulename, const char *assetname)
 {
-    zlist_t *params = zlist_new ();
-    zlist_autofree (params);
+    size_t rule_len = rulename ? strlen (rulename) : 0;
+    size_t asset_len = assetname ? strlen (assetname) : 0;
+    zlist_t *keys = zhash_keys (self->alerts);
+    for (char *key = (char *) zlist_first (keys); key; key = (char *) zlist_next (keys)) {
+        size_t len = strlen (key);
+        if ((rulename && len > rule_len && key[rule_len] == '@' && strncmp (key, rulename, rule_len) == 0) ||
+            (assetname && len > asset_len && key[len - asset_len - 1] == '@' && streq (key + len - asset_len, assetname)))
+            zhash_delete (self->alerts, key);
+    }
+    zlist_destroy (&keys);
+}
+
+//  Append "param = value" to audit buffer, truncating when full
+static void
+s_audit_append (char *audit, size_t size, size_t *len, const char *param, const char *value)
+{
+    if (*len >= size - 1) return;
+    int n = snprintf (audit + *len, size - *len, "%s%s = %s", *len ? ", " : "", param, value);
+    if (n > 0)
+        *len = (*len + n < size) ? *len + n : size - 1;
+}
 
-    bool isMetricMissing = false;
-    std::vector<std::string> auditValues;
+//  Collect params of job from metric cache, false if rule can't be evaluated
+static bool
+flexible_alert_eval_prepare (flexible_alert_t *self, eval_job_t *job)
+{
+    rule_t *rule = job->rule;
+    if (rule_quarantined (rule)) {
+        log_trace ("rule %s is quarantined", rule_name (rule));
+        return false;
+    }
+    size_t audit_len = 0;
+    job->count = 0;
+    job->ttl = 0;
+    job->missing = false;
+    job->runnable = true;
+    job->result = 0;
+    job->message = NULL;
+    job->message_heap = NULL;
+    job->audit[0] = 0;
 
     // prepare lua function parameters
-    int ttl = 0;
     const char *param = rule_metric_first (rule);
     while (param) {
-        char *topic = NULL;
-        asprintf (&topic, "%s@%s", param, assetname);
-        fty_proto_t *ftymsg = (fty_proto_t *) zhash_lookup (self->metrics, topic);
-        if (!ftymsg) {
+        char topic[512];
+        snprintf (topic, sizeof (topic), "%s@%s", param, job->assetname);
+        cached_metric_t *metric = metric_cache_lookup (self->metrics, topic);
+        if (!metric) {
             // some metrics are missing
-            zlist_destroy (&params);
             log_trace ("abort evaluation of rule %s because %s metric is missing", rule_name(rule), topic);
-            zstr_free (&topic);
-            std::stringstream ss;
-            ss << param << " = " << "NaN";
-            auditValues.push_back(ss.str());
-            isMetricMissing = true;
+            s_audit_append (job->audit, sizeof (job->audit), &audit_len, param, "NaN");
+            job->missing = true;
             break;
         }
+        if (job->count == RULE_MAX_PARAMS) {
+            log_error ("rule %s uses more than %d metrics", rule_name (rule), RULE_MAX_PARAMS);
+            return false;
+        }
         // TTL should be set accorning shortest ttl in metric
-        if (ttl == 0 || ttl > (int) fty_proto_ttl (ftymsg)) ttl = fty_proto_ttl (ftymsg);
-        zstr_free (&topic);
-        const char *value = fty_proto_value (ftymsg);
-        zlist_append (params, (char *) value);
+        if (job->ttl == 0 || job->ttl > (int) metric->ttl) job->ttl = metric->ttl;
+        const char *value = cached_metric_value (metric);
+        job->params[job->count++] = value;
 
-        std::stringstream ss;
-        ss << param << " = " << value;
-        auditValues.push_back(ss.str());
+        s_audit_append (job->audit, sizeof (job->audit), &audit_len, param, value);
 
         param = rule_metric_next (rule);
     }
+    return true;
+}
 
-    int result = 0;
-    char *message = NULL;
-
-    // if no metric is missing
-    if (!isMetricMissing) {
-
-        // call the lua function
-        rule_evaluate (rule, params, assetname, ename, &result, &message);
+//  Call the lua function, touches only the rule and its lua state
+static void
+flexible_alert_eval_run (eval_job_t *job)
+{
+    if (job->missing)
+        return;
+    if (!job->runnable) {
+        job->result = RULE_ERROR;
+        return;
+    }
+    rule_evaluate (job->rule, job->params, job->count, job->assetname, job->ename, &job->result, &job->message);
+    if (job->message && job->copy_message) {
+        size_t len = strlen (job->message);
+        if (len < sizeof (job->message_buf)) {
+            memcpy (job->message_buf, job->message, len + 1);
+            job->message = job->message_buf;
+        }
+        else
+            job->message = job->message_heap = strdup (job->message);
+    }
 
-        log_debug(ANSI_COLOR_WHITE_ON_BLUE  "rule_evaluate %s, assetname: %s: result = %d" ANSI_COLOR_RESET,
-            rule_name(rule), assetname, result);
+    log_debug(ANSI_COLOR_WHITE_ON_BLUE  "rule_evaluate %s, assetname: %s: result = %d" ANSI_COLOR_RESET,
+        rule_name(job->rule), job->assetname, job->result);
+}
 
-        if (result != RULE_ERROR) {
-            flexible_alert_send_alert (
-                self,
-                rule,
-                assetname,
-                result,
-                message, ttl * 5 / 2
-            );
+//  Publish result of job and log it to audit. Lua context of quarantined
+//  rule is released here, on the actor thread.
+static void
+flexible_alert_eval_finish (flexible_alert_t *self, eval_job_t *job)
+{
+    rule_t *rule = job->rule;
+    const char *message = job->message;
+
+    if (!job->missing) {
+        self->evaluations++;
+        if (job->result != RULE_ERROR) {
+            if (flexible_alert_alert_changed (self, rule, job->assetname, job->result, message, job->ttl * 5 / 2)) {
+                flexible_alert_send_alert (
+                    self,
+                    rule,
+                    job->assetname,
+                    job->result,
+                    message, job->ttl * 5 / 2
+                );
+            }
         }
         else {
             log_error (ANSI_COLOR_RED "error evaluating rule %s" ANSI_COLOR_RESET, rule_name (rule));
         }
-        zstr_free (&message);
-        zlist_destroy (&params);
     }
 
     // log audit alarm
-    std::stringstream ss;
-    std::for_each(begin(auditValues), end(auditValues), [&ss](const std::string &elem) { if (ss.str().empty()) ss << elem; else ss << ", " << elem; } );
-    std::string sResult;
-    switch (result) {
-      case   0: sResult = !isMetricMissing ? "OK" : "MISSING_VALUE"; break;
+    const char *sResult;
+    switch (job->result) {
+      case   0: sResult = !job->missing ? "OK" : "MISSING_VALUE"; break;
       case   1: sResult = "HIGH_WARNING"; break;
       case   2: sResult = "HIGH_CRITICAL"; break;
       case  -1: sResult = "LOW_WARNING"; break;
@@ -292,7 +1148,56 @@ flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *asset
       case 255: sResult = "RULE_ERROR"; break;
       default:  sResult = "BAD_VALUE"; break;
     }
-    log_info_alarms_flexible_audit("Evaluate rule '%s', assetname: %s [%s] -> result = %s, message = '%s'", rule_name(rule), assetname, ss.str().c_str(), sResult.c_str(), message ? message : "");
+    log_info_alarms_flexible_audit("Evaluate rule '%s', assetname: %s [%s] -> result = %s, message = '%s'", rule_name(rule), job->assetname, job->audit, sResult, message ? message : "");
+    zstr_free (&job->message_heap);
+    if (rule_quarantined (rule))
+        rule_lua_release (rule);
+}
+
+static void
+flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *assetname, const char *ename)
+{
+    // finished right after run, message is used straight from lua state
+    eval_job_t job;
+    job.rule = rule;
+    job.assetname = assetname;
+    job.ename = ename;
+    job.copy_message = false;
+    if (!flexible_alert_eval_prepare (self, &job))
+        return;
+    flexible_alert_eval_run (&job);
+    flexible_alert_eval_finish (self, &job);
+}
+
+//  --------------------------------------------------------------------------
+//  Store metric into cache and schedule its expiry. Counts updates which
+//  queued an expiry entry, rebuilt the table or stored the topic or value
+//  out of its slot: these may allocate, other updates don't. This counts
+//  paths, not malloc calls, the benchmark reports those.
+
+static void
+flexible_alert_cache_metric (flexible_alert_t *self, const char *topic, fty_proto_t *ftymsg)
+{
+    int64_t expiry = (int64_t) (fty_proto_time (ftymsg) + fty_proto_ttl (ftymsg));
+    cached_metric_t *cached = metric_cache_lookup (self->metrics, topic);
+    bool slow = false;
+    // already scheduled topic only needs a new entry if it expires sooner
+    if (!cached || expiry < (int64_t) (cached->time + cached->ttl)) {
+        self->metrics_expiry->push (metric_expiry_t (expiry, topic));
+        slow = true;
+    }
+
+    if (!cached) {
+        bool allocated;
+        cached = metric_cache_insert (self->metrics, topic, &allocated);
+        slow = slow || allocated;
+    }
+    cached->time = fty_proto_time (ftymsg);
+    cached->ttl = fty_proto_ttl (ftymsg);
+    if (cached_metric_set_value (cached, fty_proto_value (ftymsg)))
+        slow = true;
+    if (slow)
+        self->metrics_cache_slow++;
 }
 
 //  --------------------------------------------------------------------------
@@ -301,17 +1206,27 @@ flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *asset
 static void
 flexible_alert_clean_metrics (flexible_alert_t *self)
 {
-    zlist_t *topics = zhash_keys (self->metrics);
-    char *topic = (char *) zlist_first (topics);
-    while (topic) {
-        fty_proto_t *ftymsg = (fty_proto_t *) zhash_lookup (self->metrics, topic);
-        if ( (int) (fty_proto_time (ftymsg) + fty_proto_ttl (ftymsg)) <   time (NULL)) {
+    int64_t now = (int64_t) time (NULL);
+    while (!self->metrics_expiry->empty () && self->metrics_expiry->top ().first < now) {
+        metric_expiry_t entry = self->metrics_expiry->top ();
+        self->metrics_expiry->pop ();
+
+        const char *topic = entry.second.c_str ();
+        cached_metric_t *metric = metric_cache_lookup (self->metrics, topic);
+        if (!metric)
+            continue;
+        int64_t expiry = (int64_t) (metric->time + metric->ttl);
+        if (expiry < now) {
             log_warning("delete topic %s", topic);
-            zhash_delete (self->metrics, topic);
+            metric_cache_delete (self->metrics, metric);
+            self->metrics_expired++;
+        }
+        else if (expiry > entry.first) {
+            // metric was refreshed meanwhile
+            entry.first = expiry;
+            self->metrics_expiry->push (entry);
         }
-        topic = (char *) zlist_next (topics);
     }
-    zlist_destroy (&topics);
 }
 
 
@@ -331,35 +1246,21 @@ is_gpi_metric (fty_proto_t* metric)
 
 
 //  --------------------------------------------------------------------------
-//  Function handles incoming metrics, drives lua evaluation
+//  Cache incoming metric if some rule consumes it. Returns rules to evaluate
+//  for the metric asset, NULL if there is none. Topic is filled in.
 
-static void
-flexible_alert_handle_metric (flexible_alert_t *self, fty_proto_t **ftymsg_p, bool isShm)
+static zlist_t *
+flexible_alert_consume_metric (flexible_alert_t *self, fty_proto_t *ftymsg, bool isShm, char *topic, size_t topic_size)
 {
-    if (!self || !ftymsg_p || !*ftymsg_p) return;
-    fty_proto_t *ftymsg = *ftymsg_p;
-    if (fty_proto_id (ftymsg) != FTY_PROTO_METRIC) return;
-
-    if(isShm) {
-        char *subject = NULL;
-        asprintf (&subject, "%s@%s", fty_proto_type (ftymsg), fty_proto_name (ftymsg));
-        if (zhash_lookup (self->metrics, subject)) {
-            flexible_alert_clean_metrics (self);
-        }
-        zstr_free(&subject);
-    }
-    else if (zhash_lookup (self->metrics, mlm_client_subject (self->mlm))) {
-        flexible_alert_clean_metrics (self);
-    }
+    if (fty_proto_id (ftymsg) != FTY_PROTO_METRIC) return NULL;
 
     const char *assetname = fty_proto_name (ftymsg);
     const char *quantity = fty_proto_type (ftymsg);
-    const char *ename = (const char *) zhash_lookup (self->enames, assetname);
     const char *extport = fty_proto_aux_string (ftymsg, "ext-port", NULL);
 
-    char *qty_dup = strdup(quantity);
+    int qty_len = (int) strlen (quantity);
 
-    log_trace("handle metric: assetname: %s, qty: %s, isShm: %s", assetname, qty_dup, (isShm ? "true" : "false"));
+    log_trace("handle metric: assetname: %s, qty: %s, isShm: %s", assetname, quantity, (isShm ? "true" : "false"));
 
     // fix quantity for sensors connected to other sensors
     if (extport) {
@@ -370,52 +1271,195 @@ flexible_alert_handle_metric (flexible_alert_t *self, fty_proto_t **ftymsg_p, bo
         ++qty_len_helper;
         if (*qty_len_helper == '\0') {
             log_error("malformed quantity");
-            return;
+            return NULL;
         }
         while ((*qty_len_helper != '\0') && (*qty_len_helper != '.')) ++qty_len_helper;
 
-        zstr_free(&qty_dup);
-        qty_dup = strndup(quantity, qty_len_helper - quantity);
+        qty_len = (int) (qty_len_helper - quantity);
 
-        log_trace("sensor '%s', new qty: %s", assetname, qty_dup);
+        log_trace("sensor '%s', new qty: %.*s", assetname, qty_len, quantity);
     }
 
-    zlist_t *functions_for_asset = (zlist_t *) zhash_lookup (self->assets, assetname);
-    if (! functions_for_asset) {
-        zstr_free(&qty_dup);
-        //log_debug("asset '%s' has no associated function", assetname);
+    int n = snprintf (topic, topic_size, "%.*s@%s", qty_len, quantity, assetname);
+    if (n < 0 || n >= (int) topic_size) {
+        log_error ("metric topic too long (%s@%s)", quantity, assetname);
+        return NULL;
+    }
+
+    // one probe tells whether some rule of this asset consumes the metric
+    zlist_t *rules = (zlist_t *) zhash_lookup (self->metric_rules, topic);
+    if (! rules) {
+        self->metrics_dropped++;
+        return NULL;
+    }
+
+    // we have to evaluate these rules for our asset
+    // save metric into cache, message itself stays with the caller
+    self->metrics_handled++;
+    fty_proto_set_time (ftymsg, time (NULL));
+    flexible_alert_cache_metric (self, topic, ftymsg);
+    return rules;
+}
+
+//  --------------------------------------------------------------------------
+//  Handle batch of metrics with evaluation spread over eval_workers threads.
+//  The whole batch is cached first, then every rule and asset touched by the
+//  batch is evaluated once. Jobs are partitioned by lua state of the rule,
+//  as a state can only run on one thread at a time. Workers only run lua,
+//  results are published from this thread in batch order. With one worker
+//  metrics go through flexible_alert_handle_metric instead.
+
+//  Spread heap pointers, their low bits are always zero
+static size_t
+s_pointer_hash (const void *ptr)
+{
+    uint64_t h = (uint64_t) (uintptr_t) ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
+
+//  Run parts[w] of every batch until the pool stops
+static void
+s_eval_worker (eval_pool_t *pool, size_t w)
+{
+    uint64_t batch = 0;
+    std::unique_lock<std::mutex> lock (pool->mutex);
+    while (true) {
+        pool->wake.wait (lock, [pool, batch] () { return pool->stop || pool->batch != batch; });
+        if (pool->stop)
+            break;
+        batch = pool->batch;
+        lock.unlock ();
+        for (eval_job_t *job : pool->parts[w])
+            flexible_alert_eval_run (job);
+        lock.lock ();
+        if (--pool->running == 0)
+            pool->done.notify_one ();
+    }
+}
+
+//  Start workers - 1 threads, the actor thread is the last worker
+static eval_pool_t *
+eval_pool_new (int workers)
+{
+    eval_pool_t *self = new eval_pool_t ();
+    self->batch = 0;
+    self->running = 0;
+    self->stop = false;
+    self->parts.resize (workers);
+    for (size_t w = 1; w < self->parts.size (); w++)
+        self->threads.emplace_back (s_eval_worker, self, w);
+    return self;
+}
+
+//  Set count of threads evaluating SHM batches, 1 evaluates every metric
+//  on the actor thread as it comes
+void
+flexible_alert_set_eval_workers (flexible_alert_t *self, int workers)
+{
+    workers = std::max (1, std::min (workers, EVAL_WORKERS_MAX));
+    if (workers == self->eval_workers && (workers == 1) == !self->eval_pool)
         return;
+    eval_pool_destroy (&self->eval_pool);
+    self->eval_workers = workers;
+    if (workers > 1)
+        self->eval_pool = eval_pool_new (workers);
+}
+
+static void
+flexible_alert_handle_metrics (flexible_alert_t *self, std::vector<fty_proto_t *> &metrics)
+{
+    eval_pool_t *pool = self->eval_pool;
+    assert (pool);
+    std::vector<eval_job_t> &jobs = pool->jobs;
+    jobs.clear ();
+    zhash_t *seen = zhash_new ();
+    for (fty_proto_t *ftymsg : metrics) {
+        if (!ftymsg) continue;
+        char topic[512];
+        zlist_t *rules = flexible_alert_consume_metric (self, ftymsg, true, topic, sizeof (topic));
+        if (!rules) continue;
+
+        const char *assetname = fty_proto_name (ftymsg);
+        asset_info_t *info = (asset_info_t *) zhash_lookup (self->asset_infos, assetname);
+        rule_t *rule = (rule_t *) zlist_first (rules);
+        for (; rule; rule = (rule_t *) zlist_next (rules)) {
+            char key[512];
+            snprintf (key, sizeof (key), "%s@%s", rule_name (rule), assetname);
+            if (zhash_insert (seen, key, rule) != 0)
+                continue;
+            jobs.emplace_back ();
+            eval_job_t &job = jobs.back ();
+            job.rule = rule;
+            job.assetname = assetname;
+            job.ename = info ? info->ename : NULL;
+            // rule or its lua state runs other jobs before this one is finished
+            job.copy_message = true;
+        }
+    }
+    zhash_destroy (&seen);
+
+    // cache is complete, params can be borrowed from it now
+    for (auto &part : pool->parts)
+        part.clear ();
+    for (eval_job_t &job : jobs) {
+        job.valid = flexible_alert_eval_prepare (self, &job);
+        if (!job.valid || job.missing)
+            continue;
+        // compile here, rule compilation shares state between rules
+        const void *key = rule_lua_key (job.rule);
+        job.runnable = key != NULL;
+        pool->parts[s_pointer_hash (key) % pool->parts.size ()].push_back (&job);
     }
 
-    // this asset has some evaluation functions
-    bool metric_saved =  false;
-    char *func = (char *) zlist_first (functions_for_asset);
-    for (; func; func = (char *) zlist_next (functions_for_asset))
+    int64_t start = zclock_usecs ();
     {
-        rule_t *rule = (rule_t *) zhash_lookup (self -> rules, func);
-        if (!rule) continue;
-        if (!rule_metric_exists (rule, qty_dup)) continue;
+        std::lock_guard<std::mutex> lock (pool->mutex);
+        pool->batch++;
+        pool->running = pool->threads.size ();
+    }
+    pool->wake.notify_all ();
+    for (eval_job_t *job : pool->parts[0])
+        flexible_alert_eval_run (job);
+    {
+        std::unique_lock<std::mutex> lock (pool->mutex);
+        pool->done.wait (lock, [pool] () { return pool->running == 0; });
+    }
+    log_debug ("evaluated %zu rules in %lld us (workers: %zu)",
+        jobs.size (), (long long) (zclock_usecs () - start), pool->parts.size ());
 
-        log_debug("qty '%s' exists in '%s'", qty_dup, rule_name(rule));
+    for (eval_job_t &job : jobs) {
+        if (job.valid)
+            flexible_alert_eval_finish (self, &job);
+    }
+}
 
-        // we have to evaluate this function/rule for our asset
-        // save metric into cache
-        if (! metric_saved) {
-            fty_proto_set_time (ftymsg, time (NULL));
-            //char *topic = zsys_sprintf ("%s@%s", qty_dup, assetname);
-            char *topic = NULL;
-            asprintf (&topic, "%s@%s", qty_dup, assetname);
-            zhash_update (self->metrics, topic, ftymsg);
-            zhash_freefn (self->metrics, topic, ftymsg_freefn);
-            *ftymsg_p = NULL;
-            zstr_free (&topic);
-            metric_saved = true;
-        }
+//  --------------------------------------------------------------------------
+//  Function handles incoming metrics, drives lua evaluation
+
+static void
+flexible_alert_handle_metric (flexible_alert_t *self, fty_proto_t **ftymsg_p, bool isShm)
+{
+    if (!self || !ftymsg_p || !*ftymsg_p) return;
+    fty_proto_t *ftymsg = *ftymsg_p;
+
+    char topic[512];
+    zlist_t *rules = flexible_alert_consume_metric (self, ftymsg, isShm, topic, sizeof (topic));
+    if (!rules)
+        return;
+
+    const char *assetname = fty_proto_name (ftymsg);
+    asset_info_t *info = (asset_info_t *) zhash_lookup (self->asset_infos, assetname);
+    const char *ename = info ? info->ename : NULL;
 
-        // evaluate
+    rule_t *rule = (rule_t *) zlist_first (rules);
+    for (; rule; rule = (rule_t *) zlist_next (rules))
+    {
+        log_debug("topic '%s' exists in '%s'", topic, rule_name(rule));
         flexible_alert_evaluate (self, rule, assetname, ename);
     }
-    zstr_free(&qty_dup);
 }
 
 static int
@@ -459,66 +1503,35 @@ flexible_alert_handle_metric_sensor (flexible_alert_t *self, fty_proto_t **ftyms
         return;
     }
 
-    ask_for_sensor (self, sensor_name);
-    fty_proto_set_name (ftymsg, "%s", sensor_name);
-    flexible_alert_handle_metric(self, ftymsg_p, false);
-}
-
-//  --------------------------------------------------------------------------
-//  Function returns true if rule should be evaluated for particular asset.
-//  This is decided by asset name (json "assets": []) or group (json "groups":[])
-
-static int
-is_rule_for_this_asset (rule_t *rule, fty_proto_t *ftymsg)
-{
-    if (!rule || !ftymsg) return 0;
-
-    const char *subtype = fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_SUBTYPE, "");
-    if (streq (subtype, "sensorgpio") )
-    {
-        if (rule_asset_exists (rule, fty_proto_name (ftymsg)) &&
-            rule_model_exists (rule, fty_proto_ext_string (ftymsg, FTY_PROTO_ASSET_EXT_MODEL, "")) )
-            return 1;
-        else
-            return 0;
-    }
-
-    if (rule_asset_exists (rule, fty_proto_name (ftymsg)))
-        return 1;
-
-    zhash_t *ext = fty_proto_ext (ftymsg);
-    zlist_t *keys = zhash_keys (ext);
-    char *key = (char *)zlist_first (keys);
-    while (key) {
-        if (strncmp ("group.", key, 6) == 0) {
-            // this is group
-            if (rule_group_exists (rule, (char *) zhash_lookup (ext, key))) {
-                zlist_destroy (&keys);
-                return 1;
-            }
-        }
-        key = (char *)zlist_next (keys);
-    }
-    zlist_destroy (&keys);
-
-    if (rule_model_exists (rule, fty_proto_ext_string (ftymsg, FTY_PROTO_ASSET_EXT_MODEL, "")))
-        return 1;
-    if (rule_model_exists (rule, fty_proto_ext_string (ftymsg, FTY_PROTO_ASSET_EXT_DEVICE_PART, "")))
-        return 1;
+    ask_for_sensor (self, sensor_name);
+    fty_proto_set_name (ftymsg, "%s", sensor_name);
+    flexible_alert_handle_metric(self, ftymsg_p, false);
+}
 
-    if (rule_type_exists (rule, fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_AUX_TYPE, "")))
-        return 1;
-    if (rule_type_exists (rule, fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_AUX_SUBTYPE, "")))
-        return 1;
+//  --------------------------------------------------------------------------
+//  Returns true if both lists of strings hold the same items in the same order
 
-    return 0;
+static bool
+s_zlist_equals (zlist_t *list1, zlist_t *list2)
+{
+    if (!list1 || !list2) return list1 == list2;
+    if (zlist_size (list1) != zlist_size (list2)) return false;
+
+    const char *item1 = (const char *) zlist_first (list1);
+    const char *item2 = (const char *) zlist_first (list2);
+    while (item1 && item2) {
+        if (!streq (item1, item2)) return false;
+        item1 = (const char *) zlist_next (list1);
+        item2 = (const char *) zlist_next (list2);
+    }
+    return true;
 }
 
 //  --------------------------------------------------------------------------
 //  When asset message comes, function checks if we have rule for it and stores
 //  list of rules valid for this asset.
 
-static void
+void
 flexible_alert_handle_asset (flexible_alert_t *self, fty_proto_t *ftymsg)
 {
     if (!self || !ftymsg) return;
@@ -530,41 +1543,41 @@ flexible_alert_handle_asset (flexible_alert_t *self, fty_proto_t *ftymsg)
     if (streq (operation, FTY_PROTO_ASSET_OP_DELETE) ||
             !streq(fty_proto_aux_string (ftymsg, FTY_PROTO_ASSET_STATUS, "active"), "active")) {
         if (zhash_lookup (self->assets, assetname)) {
+            flexible_alert_unindex_asset (self, assetname);
             zhash_delete (self->assets, assetname);
+            // stop polling the asset
+            self->shm_patterns_dirty = true;
         }
-        if (zhash_lookup (self->enames, assetname)) {
-            zhash_delete (self->enames, assetname);
-        }
+        zhash_delete (self->asset_infos, assetname);
+        flexible_alert_forget_alerts (self, NULL, assetname);
         return;
     }
 
     if (streq (operation, FTY_PROTO_ASSET_OP_UPDATE) ||
             streq (operation, FTY_PROTO_ASSET_OP_INVENTORY)) {
-        zlist_t *functions_for_asset = zlist_new ();
-        zlist_autofree (functions_for_asset);
+        // keep attributes, rules added later are bound without asset agent
+        asset_info_t *info = asset_info_new (ftymsg);
+        zhash_update (self->asset_infos, assetname, info);
+        zhash_freefn (self->asset_infos, assetname, asset_info_freefn);
 
-        rule_t *rule = (rule_t *)zhash_first (self->rules);
-        while (rule) {
-            if (is_rule_for_this_asset (rule, ftymsg)) {
-                zlist_append (functions_for_asset, (char *)rule_name (rule));
-                log_debug ("rule '%s' is valid for '%s'", rule_name (rule), assetname);
-            }
-            rule = (rule_t *)zhash_next (self->rules);
-        }
+        zlist_t *functions_for_asset = flexible_alert_match_asset (self, assetname, info);
 
+        bool rebound = !s_zlist_equals (functions_for_asset, (zlist_t *) zhash_lookup (self->assets, assetname));
+        flexible_alert_unindex_asset (self, assetname);
         if (zlist_size (functions_for_asset) == 0) {
             log_trace ("no rule for %s", assetname);
+            if (zhash_lookup (self->assets, assetname))
+                self->shm_patterns_dirty = true;
             zhash_delete (self->assets, assetname);
             zlist_destroy (&functions_for_asset);
             return;
         }
         zhash_update (self->assets, assetname, functions_for_asset);
         zhash_freefn (self->assets, assetname, asset_freefn);
-
-        const char *ename = fty_proto_ext_string (ftymsg, "name", NULL);
-        if (ename) {
-            zhash_update (self->enames, assetname, (void *)ename);
-            zhash_freefn (self->enames, assetname, ename_freefn);
+        flexible_alert_index_asset (self, assetname, functions_for_asset);
+        if (rebound) {
+            self->shm_patterns_dirty = true;
+            flexible_alert_shm_resync (self);
         }
     }
 }
@@ -573,9 +1586,28 @@ flexible_alert_handle_asset (flexible_alert_t *self, fty_proto_t *ftymsg)
 //  handling requests for list of rules.
 //  type can be all or flexible in this agent
 //  class is just for compatibility with alert engine protocol
+//  options are optional "key=value" frames narrowing the reply:
+//      name=<prefix>   rules whose name starts with prefix
+//      asset=<name>    rules bound to the asset
+//      metric=<name>   rules consuming the metric
+//      asset_type=<type>   rules applied to assets of the type
+//      after=<token>   continuation token of previous page
+//      offset=<n>      skip first n matching rules
+//      limit=<n>       at most n rules in reply, 0 for all
+//  With options, rules are sorted by name and reply carries continuation
+//  token in front of rules, empty on last page.
+
+static void
+s_list_options_destroy (zlist_t **items_p)
+{
+    char *item;
+    while ((item = (char *) zlist_pop (*items_p)))
+        zstr_free (&item);
+    zlist_destroy (items_p);
+}
 
 static zmsg_t *
-flexible_alert_list_rules (flexible_alert_t *self, char *type, char *ruleclass)
+flexible_alert_list_rules (flexible_alert_t *self, char *type, char *ruleclass, zmsg_t *options)
 {
     if (! self || ! type) return NULL;
 
@@ -587,24 +1619,125 @@ flexible_alert_list_rules (flexible_alert_t *self, char *type, char *ruleclass)
         return reply;
     }
 
+    bool filtered = options && zmsg_size (options) > 0;
+    const char *name = NULL, *asset = NULL, *metric = NULL, *asset_type = NULL, *after = NULL;
+    size_t offset = 0, limit = 0;
+    zlist_t *items = zlist_new ();      // option frames, values point there
+    bool valid = true;
+    while (valid && options && zmsg_size (options)) {
+        char *item = zmsg_popstr (options);
+        if (!item) break;
+        zlist_append (items, item);
+        char *value = strchr (item, '=');
+        if (!value) {
+            valid = false;
+            break;
+        }
+        *value++ = 0;
+        if (streq (item, "name")) name = value;
+        else if (streq (item, "asset")) asset = value;
+        else if (streq (item, "metric")) metric = value;
+        else if (streq (item, "asset_type")) asset_type = value;
+        else if (streq (item, "after")) after = value;
+        else if (streq (item, "offset")) offset = strtoul (value, NULL, 10);
+        else if (streq (item, "limit")) limit = strtoul (value, NULL, 10);
+        else valid = false;
+    }
+    if (!valid) {
+        s_list_options_destroy (&items);
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, "INVALID_OPTION");
+        return reply;
+    }
+
     zmsg_addstr (reply, "LIST");
     zmsg_addstr (reply, type);
     zmsg_addstr (reply, ruleclass ? ruleclass : "");
 
-    rule_t *rule = (rule_t *) zhash_first (self->rules);
-    while (rule) {
-        char *json = rule_json (rule);
-        if (json) {
-            char *uistyle = NULL;
-            asprintf (&uistyle, "{\"flexible\": %s }", json);
-            if (uistyle) {
-                zmsg_addstr (reply, uistyle);
-                zstr_free (&uistyle);
-            }
-            zstr_free (&json);
+    if (!filtered) {
+        rule_t *rule = (rule_t *) zhash_first (self->rules);
+        while (rule) {
+            size_t size;
+            const char *json = rule_json_cached (rule, true, &size);
+            if (json)
+                zmsg_addmem (reply, json, size);
+            rule = (rule_t *) zhash_next (self->rules);
+        }
+        s_list_options_destroy (&items);
+        return reply;
+    }
+
+    //  Candidates come from the narrowest index available, other filters
+    //  are checked on rules themselves or on the metric index
+    bool by_metric = metric && !streq (metric, "");
+    zlist_t *metric_rules = NULL;       // NULL with by_metric, no rule has it
+    if (by_metric) {
+        char key[512];
+        snprintf (key, sizeof (key), "q:%s", metric);
+        metric_rules = (zlist_t *) zhash_lookup (self->match_rules, key);
+    }
+    zlist_t *candidates = zlist_new ();
+    if (asset && !streq (asset, "")) {
+        zlist_t *bound = (zlist_t *) zhash_lookup (self->assets, asset);
+        const char *rulename = bound ? (const char *) zlist_first (bound) : NULL;
+        for (; rulename; rulename = (const char *) zlist_next (bound)) {
+            rule_t *rule = (rule_t *) zhash_lookup (self->rules, rulename);
+            if (rule) zlist_append (candidates, rule);
         }
-        rule = (rule_t *) zhash_next (self->rules);
     }
+    else if (by_metric) {
+        s_match_candidates (self->match_rules, "q", metric, candidates);
+    }
+    else if (asset_type && !streq (asset_type, "")) {
+        s_match_candidates (self->match_rules, "t", asset_type, candidates);
+    }
+    else {
+        rule_t *rule = (rule_t *) zhash_first (self->rules);
+        for (; rule; rule = (rule_t *) zhash_next (self->rules))
+            zlist_append (candidates, rule);
+    }
+
+    zlist_t *names = zlist_new ();
+    size_t prefix = name ? strlen (name) : 0;
+    rule_t *rule = (rule_t *) zlist_first (candidates);
+    for (; rule; rule = (rule_t *) zlist_next (candidates)) {
+        const char *rulename = rule_name (rule);
+        if (!rulename)
+            continue;
+        if (prefix && strncmp (rulename, name, prefix) != 0)
+            continue;
+        if (after && !streq (after, "") && strcmp (rulename, after) <= 0)
+            continue;
+        if (by_metric && !(metric_rules && zlist_exists (metric_rules, rule)))
+            continue;
+        if (asset_type && !streq (asset_type, "") && !rule_type_exists (rule, asset_type))
+            continue;
+        zlist_append (names, (void *) rulename);
+    }
+    zlist_sort (names, s_string_compare);
+
+    //  Collect the page first, continuation token goes in front of it
+    zlist_t *page = zlist_new ();
+    const char *rulename = (const char *) zlist_first (names);
+    for (size_t i = 0; rulename && i < offset; i++)
+        rulename = (const char *) zlist_next (names);
+    for (; rulename && (!limit || zlist_size (page) < limit); rulename = (const char *) zlist_next (names))
+        zlist_append (page, (void *) rulename);
+    const char *next = rulename && zlist_size (page) ? (const char *) zlist_last (page) : "";
+    zmsg_addstr (reply, next);
+
+    for (rulename = (const char *) zlist_first (page); rulename; rulename = (const char *) zlist_next (page)) {
+        size_t size;
+        const char *json = rule_json_cached ((rule_t *) zhash_lookup (self->rules, rulename), true, &size);
+        if (json)
+            zmsg_addmem (reply, json, size);
+    }
+    log_debug ("LIST: %zu of %zu candidates matched, %zu sent", zlist_size (names), zlist_size (candidates), zlist_size (page));
+
+    zlist_destroy (&page);
+    zlist_destroy (&names);
+    zlist_destroy (&candidates);
+    s_list_options_destroy (&items);
     return reply;
 }
 
@@ -619,10 +1752,10 @@ flexible_alert_get_rule (flexible_alert_t *self, char *name)
     rule_t *rule = (rule_t *) zhash_lookup (self->rules, name);
     zmsg_t *reply = zmsg_new ();
     if (rule) {
-        char *json = rule_json (rule);
+        size_t size;
+        const char *json = rule_json_cached (rule, false, &size);
         zmsg_addstr (reply, "OK");
-        zmsg_addstr (reply, json);
-        zstr_free (&json);
+        zmsg_addmem (reply, json, json ? size : 0);
     }
     else {
         zmsg_addstr (reply, "ERROR");
@@ -649,7 +1782,10 @@ flexible_alert_delete_rule (flexible_alert_t *self, const char *name, const char
         asprintf (&path, "%s/%s.rule", dir, name);
         if (unlink (path) == 0) {
             zmsg_addstr (reply, "OK");
+            rule_bytecode_remove (name);
+            flexible_alert_forget_alerts (self, name, NULL);
             zhash_delete (self->rules, name);
+            flexible_alert_reindex (self);
         } else {
             log_error ("Can't remove %s", path);
             zmsg_addstr (reply, "ERROR");
@@ -718,20 +1854,8 @@ flexible_alert_add_rule (flexible_alert_t *self, const char *json, const char *o
             log_info ("Loading rule %s done (%s)", path, (rule ? "success" : "failed"));
 
             if (rule) {
-                // we need to update our lists
-                zlist_t* assets = zhash_keys (self->assets);
-                const char* asset = (const char*) zlist_first(assets);
-                while (asset) {
-                    if (rule_asset_exists(rule, asset)) {
-                        zmsg_t *msg = zmsg_new ();
-                        zmsg_addstr (msg, "REPUBLISH");
-                        zmsg_addstr (msg, asset);
-                        mlm_client_sendto (self->mlm, "asset-agent", "REPUBLISH" , NULL, 5000, &msg);
-                        zmsg_destroy (&msg);
-                    }
-                    asset = (const char*) zlist_next(assets);
-                }
-                zlist_destroy (&assets);
+                // binds the new rule to every matching known asset
+                flexible_alert_reindex (self);
             }
         }
         zstr_free (&path);
@@ -740,15 +1864,235 @@ flexible_alert_add_rule (flexible_alert_t *self, const char *json, const char *o
     return reply;
 }
 
+//  --------------------------------------------------------------------------
+//  handling requests for runtime statistics. Rules come with most lua time
+//  first, limit is the count of rules reported, 0 or NULL for all of them.
+
+static void
+s_stats_append (std::string &json, const char *key, uint64_t value)
+{
+    json += '"';
+    json += key;
+    json += "\":";
+    json += std::to_string (value);
+}
+
+static zmsg_t *
+flexible_alert_stats (flexible_alert_t *self, const char *limit)
+{
+    if (!self) return NULL;
+
+    std::string json = "{\"metrics\":{\"received\":{";
+    uint64_t received = 0;
+    for (int i = 0; i < METRIC_STREAMS; i++) {
+        char *stream = vsjson_encode_string (s_metric_streams [i]);
+        if (i) json += ',';
+        json += stream;
+        json += ':';
+        json += std::to_string (self->metrics_received [i]);
+        zstr_free (&stream);
+        received += self->metrics_received [i];
+    }
+    json += "},";
+    s_stats_append (json, "total", received);
+    json += ',';
+    s_stats_append (json, "consumed", self->metrics_handled);
+    json += ',';
+    s_stats_append (json, "dropped", self->metrics_dropped);
+    json += ',';
+    s_stats_append (json, "cached", self->metrics->size);
+    json += ',';
+    s_stats_append (json, "expired", self->metrics_expired);
+    json += "},\"alerts\":{";
+    s_stats_append (json, "published", self->alerts_published);
+    json += ',';
+    s_stats_append (json, "suppressed", self->alerts_suppressed);
+    json += ',';
+    s_stats_append (json, "pending", zlist_size (self->alerts_pending));
+    json += "},";
+    s_stats_append (json, "evaluations", self->evaluations);
+    json += ",\"shm_poll\":{";
+    s_stats_append (json, "read_us", (uint64_t) self->shm_poll_read_us);
+    json += ',';
+    s_stats_append (json, "handle_us", (uint64_t) self->shm_poll_handle_us);
+    json += ',';
+    s_stats_append (json, "metrics", (uint64_t) self->shm_poll_metrics);
+    json += ',';
+    s_stats_append (json, "unchanged", (uint64_t) self->shm_poll_unchanged);
+    json += ",\"age_ms\":";
+    json += self->shm_poll_time ? std::to_string (zclock_mono () - self->shm_poll_time) : "null";
+    json += "},\"rules\":[";
+
+    std::vector<std::pair<uint64_t, rule_t *>> rules;
+    rules.reserve (zhash_size (self->rules));
+    size_t quarantined = 0;
+    for (rule_t *rule = (rule_t *) zhash_first (self->rules); rule; rule = (rule_t *) zhash_next (self->rules)) {
+        uint64_t evaluations, errors, lua_usecs;
+        rule_eval_stats (rule, &evaluations, &errors, &lua_usecs);
+        rules.emplace_back (lua_usecs, rule);
+        if (rule_quarantined (rule))
+            quarantined++;
+    }
+    std::sort (rules.begin (), rules.end (), [] (const std::pair<uint64_t, rule_t *> &a, const std::pair<uint64_t, rule_t *> &b) {
+        return a.first != b.first ? a.first > b.first : strcmp (rule_name (a.second), rule_name (b.second)) < 0;
+    });
+    size_t count = limit ? strtoul (limit, NULL, 10) : 0;
+    if (count == 0 || count > rules.size ())
+        count = rules.size ();
+
+    for (size_t i = 0; i < count; i++) {
+        rule_t *rule = rules [i].second;
+        uint64_t evaluations, errors, lua_usecs;
+        rule_eval_stats (rule, &evaluations, &errors, &lua_usecs);
+        char *name = vsjson_encode_string (rule_name (rule));
+        if (i) json += ',';
+        json += "{\"name\":";
+        json += name;
+        json += ',';
+        zstr_free (&name);
+        s_stats_append (json, "evaluations", evaluations);
+        json += ',';
+        s_stats_append (json, "errors", errors);
+        json += ',';
+        s_stats_append (json, "lua_us", lua_usecs);
+        json += ',';
+        s_stats_append (json, "lua_p50_us", rule_lua_percentile (rule, 50));
+        json += ',';
+        s_stats_append (json, "lua_p99_us", rule_lua_percentile (rule, 99));
+        json += ',';
+        s_stats_append (json, "budget_exceeded", rule_budget_exceeded (rule));
+        json += ",\"quarantined\":";
+        json += rule_quarantined (rule) ? "true" : "false";
+        json += '}';
+    }
+    json += "],";
+    s_stats_append (json, "quarantined", quarantined);
+    json += '}';
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "STATS");
+    zmsg_addstr (reply, json.c_str ());
+    return reply;
+}
+
+//  --------------------------------------------------------------------------
+//  SHM change detection. The polling actor remembers the last value and time
+//  of every "quantity@asset" read from SHM, and only delivers metrics which
+//  changed since the previous poll.
+
+typedef struct {
+    char *value;
+    uint64_t time;
+    uint64_t poll;          // last poll in which the topic was read
+} shm_sample_t;
+
+void
+shm_sample_destroy (void **item_p)
+{
+    if (!item_p || !*item_p) return;
+    shm_sample_t *sample = (shm_sample_t *) *item_p;
+    zstr_free (&sample->value);
+    free (sample);
+    *item_p = NULL;
+}
+
+//  Returns true if metric differs from what was read in the previous poll
+static bool
+shm_sample_changed (zhashx_t *samples, fty_proto_t *metric, uint64_t poll)
+{
+    char topic[512];
+    int n = snprintf (topic, sizeof (topic), "%s@%s", fty_proto_type (metric), fty_proto_name (metric));
+    if (n < 0 || n >= (int) sizeof (topic))
+        return true;
+
+    const char *value = fty_proto_value (metric);
+    shm_sample_t *sample = (shm_sample_t *) zhashx_lookup (samples, topic);
+    if (!sample) {
+        sample = (shm_sample_t *) zmalloc (sizeof (shm_sample_t));
+        sample->value = strdup (value);
+        sample->time = fty_proto_time (metric);
+        sample->poll = poll;
+        zhashx_insert (samples, topic, sample);
+        return true;
+    }
+    sample->poll = poll;
+    if (sample->time == fty_proto_time (metric) && streq (sample->value, value))
+        return false;
+
+    zstr_free (&sample->value);
+    sample->value = strdup (value);
+    sample->time = fty_proto_time (metric);
+    return true;
+}
+
+//  Forget topics which disappeared from SHM
+static void
+shm_samples_sweep (zhashx_t *samples, uint64_t poll)
+{
+    zlist_t *stale = zlist_new ();
+    zlist_autofree (stale);
+    shm_sample_t *sample = (shm_sample_t *) zhashx_first (samples);
+    while (sample) {
+        if (sample->poll != poll)
+            zlist_append (stale, (void *) zhashx_cursor (samples));
+        sample = (shm_sample_t *) zhashx_next (samples);
+    }
+    const char *topic = (const char *) zlist_first (stale);
+    while (topic) {
+        zhashx_delete (samples, topic);
+        topic = (const char *) zlist_next (stale);
+    }
+    zlist_destroy (&stale);
+}
+
+//  Read metrics matching patterns from SHM. Unchanged ones are destroyed,
+//  leaving NULL in the returned batch. Caller owns the batch.
+fty::shm::shmMetrics *
+shm_poll (zhashx_t *samples, const char *assets_pattern, const char *metrics_pattern, uint64_t poll, int *skipped)
+{
+    fty::shm::shmMetrics *result = new fty::shm::shmMetrics ();
+    fty::shm::read_metrics(assets_pattern, metrics_pattern, *result);
+    *skipped = 0;
+    for (auto &element : *result) {
+        if (element && !shm_sample_changed (samples, element, poll)) {
+            fty_proto_destroy (&element);
+            ++*skipped;
+        }
+    }
+    if (zhashx_size (samples) > result->size ())
+        shm_samples_sweep (samples, poll);
+    return result;
+}
+
+//  --------------------------------------------------------------------------
+//  SHM polling actor. It only reads metrics from SHM and hands every batch
+//  over to the main actor as a "METRICS" message carrying a pointer to a
+//  heap allocated fty::shm::shmMetrics. Rules, assets and the metric cache
+//  are owned by the main actor thread and never touched here.
+//
+//  Metrics unchanged since the previous poll are dropped from the batch.
+//  The main actor sends "RESYNC" when rules or asset bindings change, so
+//  that the next batch is complete again and flagged as such.
+//
+//  The main actor narrows the SHM patterns with "PATTERNS/assets/metrics"
+//  to what loaded rules can consume. Empty patterns mean nothing is read.
+//
+//  message: METRICS/batch pointer/complete flag/metrics read/metrics skipped/read duration (us)
+
 static void
 flexible_alert_metric_polling (zsock_t *pipe, void *args)
 {
     zpoller_t *poller = zpoller_new (pipe, NULL);
     zsock_signal (pipe, 0);
     zlist_t *params = (zlist_t*) args;
-    char* assets_pattern = (char*)zlist_first (params);
-    char* metrics_pattern = (char*)zlist_next (params);
-    flexible_alert_t *self = (flexible_alert_t*)zlist_next (params);;
+    char *assets_pattern = strdup ((char*)zlist_first (params));
+    char *metrics_pattern = strdup ((char*)zlist_next (params));
+    zlist_destroy(&params);
+
+    zhashx_t *samples = zhashx_new ();
+    zhashx_set_destructor (samples, shm_sample_destroy);
+    uint64_t poll = 0;
+    bool complete = true;
 
     log_info("flexible_alert_metric_polling started (assets_pattern: %s, metrics_pattern: %s)", assets_pattern, metrics_pattern);
 
@@ -760,12 +2104,27 @@ flexible_alert_metric_polling (zsock_t *pipe, void *args)
         }
 
         if (zpoller_expired (poller)) {
-            fty::shm::shmMetrics result;
-            fty::shm::read_metrics(assets_pattern, metrics_pattern, result);
-            log_debug("poll: read metrics from SHM (size: %d, assets: %s, metrics: %s)", result.size(), assets_pattern, metrics_pattern);
-            for (auto &element : result) {
-                flexible_alert_handle_metric(self, &element, true);
+            if (streq (assets_pattern, "") || streq (metrics_pattern, "")) {
+                log_trace ("poll: no rule consumes SHM metrics");
+                continue;
+            }
+            int skipped = 0;
+            int64_t start = zclock_usecs ();
+            fty::shm::shmMetrics *result = shm_poll (samples, assets_pattern, metrics_pattern, ++poll, &skipped);
+            int duration = (int) (zclock_usecs () - start);
+
+            log_debug("poll: read metrics from SHM (size: %d, unchanged: %d, assets: %s, metrics: %s)",
+                result->size(), skipped, assets_pattern, metrics_pattern);
+            // ownership of result goes to the main actor
+            if (zsock_send (pipe, "spiiii", "METRICS", (void *) result, complete ? 1 : 0, (int) result->size (), skipped, duration) != 0) {
+                log_error ("flexible_alert_metric_polling: can't send batch");
+                delete result;
+                // next batch must carry what was lost
+                zhashx_purge (samples);
+                complete = true;
+                continue;
             }
+            complete = false;
         }
         else if (which == pipe) {
             zmsg_t *message = zmsg_recv (pipe);
@@ -777,6 +2136,26 @@ flexible_alert_metric_polling (zsock_t *pipe, void *args)
                         zmsg_destroy(&message);
                         break;
                     }
+                    else if (streq (cmd, "RESYNC")) {
+                        log_debug ("flexible_alert_metric_polling: resync");
+                        zhashx_purge (samples);
+                        complete = true;
+                    }
+                    else if (streq (cmd, "PATTERNS")) {
+                        char *assets = zmsg_popstr (message);
+                        char *metrics = zmsg_popstr (message);
+                        if (assets && metrics) {
+                            zstr_free (&assets_pattern);
+                            zstr_free (&metrics_pattern);
+                            assets_pattern = assets;
+                            metrics_pattern = metrics;
+                            log_debug ("flexible_alert_metric_polling: patterns (assets: %s, metrics: %s)", assets_pattern, metrics_pattern);
+                        }
+                        else {
+                            zstr_free (&assets);
+                            zstr_free (&metrics);
+                        }
+                    }
                     zstr_free(&cmd);
                 }
                 zmsg_destroy(&message);
@@ -786,10 +2165,115 @@ flexible_alert_metric_polling (zsock_t *pipe, void *args)
 
     log_info ("flexible_alert_metric_polling: Terminating.");
 
-    zlist_destroy(&params);
+    zhashx_destroy (&samples);
+    zstr_free (&assets_pattern);
+    zstr_free (&metrics_pattern);
     zpoller_destroy(&poller);
 }
 
+//  --------------------------------------------------------------------------
+//  Evaluate one batch read from SHM and publish its alerts, destroys batch
+
+void
+flexible_alert_handle_shm_batch (flexible_alert_t *self, fty::shm::shmMetrics *result)
+{
+    for (auto &element : *result) {
+        if (element)
+            self->metrics_received [METRIC_STREAM_SHM]++;
+    }
+    if (self->eval_pool) {
+        std::vector<fty_proto_t *> metrics;
+        metrics.reserve (result->size ());
+        for (auto &element : *result)
+            metrics.push_back (element);
+        flexible_alert_handle_metrics (self, metrics);
+    }
+    else {
+        for (auto &element : *result) {
+            flexible_alert_handle_metric(self, &element, true);
+        }
+    }
+    delete result;
+    // one poll cycle, one flush
+    flexible_alert_flush_alerts (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Handle message from SHM polling actor, runs in the main actor thread
+
+static void
+flexible_alert_handle_metric_polling (flexible_alert_t *self)
+{
+    char *cmd = NULL;
+    void *ptr = NULL;
+    int complete = 0, read = 0, skipped = 0, duration = 0;
+    if (zsock_recv (self->metric_polling, "spiiii", &cmd, &ptr, &complete, &read, &skipped, &duration) != 0) {
+        log_error ("flexible_alert_handle_metric_polling: malformed message");
+        return;
+    }
+    if (cmd && streq (cmd, "METRICS") && ptr) {
+        uint64_t handled = self->metrics_handled;
+        uint64_t slow = self->metrics_cache_slow;
+        int64_t start = zclock_usecs ();
+        flexible_alert_handle_shm_batch (self, (fty::shm::shmMetrics *) ptr);
+        self->shm_poll_handle_us = zclock_usecs () - start;
+        self->shm_poll_read_us = duration;
+        self->shm_poll_metrics = read;
+        self->shm_poll_unchanged = skipped;
+        self->shm_poll_time = zclock_mono ();
+        handled = self->metrics_handled - handled;
+        slow = self->metrics_cache_slow - slow;
+        log_debug ("handle SHM metrics (read: %d, unchanged skipped: %d, consumed: %llu, cache slow paths: %llu, alerts suppressed: %llu)",
+            read, skipped, (unsigned long long) handled, (unsigned long long) slow,
+            (unsigned long long) self->alerts_suppressed);
+
+        if (complete && self->shm_resync_pending) {
+            self->shm_resync_pending = false;
+            // something changed while the resync was in flight
+            if (self->shm_resync != self->shm_changes)
+                flexible_alert_shm_resync_send (self);
+        }
+    }
+    else {
+        log_warning ("flexible_alert_handle_metric_polling: unexpected command '%s'", cmd ? cmd : "(null)");
+        // only batches are sent with a pointer
+        delete (fty::shm::shmMetrics *) ptr;
+    }
+    zstr_free (&cmd);
+}
+
+//  --------------------------------------------------------------------------
+//  Stop SHM polling actor. Batches it sent and nobody received yet belong
+//  to the main actor, they are destroyed here instead of being dropped by
+//  the default zactor destructor.
+
+static void
+flexible_alert_metric_polling_destructor (zactor_t *actor)
+{
+    zsock_set_sndtimeo (actor, 0);
+    if (zstr_send (actor, "$TERM") != 0)
+        return;
+    while (true) {
+        zmsg_t *msg = zmsg_recv (actor);
+        if (!msg)
+            break;
+        if (zmsg_signal (msg) >= 0) {
+            zmsg_destroy (&msg);
+            break;
+        }
+        char *cmd = zmsg_popstr (msg);
+        zframe_t *frame = zmsg_pop (msg);
+        if (cmd && streq (cmd, "METRICS") && frame && zframe_size (frame) == sizeof (void *)) {
+            fty::shm::shmMetrics *batch;
+            memcpy (&batch, zframe_data (frame), sizeof (void *));
+            delete batch;
+        }
+        zframe_destroy (&frame);
+        zstr_free (&cmd);
+        zmsg_destroy (&msg);
+    }
+}
+
 //  --------------------------------------------------------------------------
 //  Actor running one instance of flexible alert class
 
@@ -801,14 +2285,39 @@ flexible_alert_actor (zsock_t *pipe, void *args)
     zsock_signal (pipe, 0);
     char *ruledir = NULL;
 
+    // SHM polling actor takes ownership of params
     zlist_t *params = (zlist_t*) args;
-    zlist_append (params, self);
-    zactor_t *metric_polling =  zactor_new (flexible_alert_metric_polling, params);
+    self->shm_assets_pattern = strdup ((char*)zlist_first (params));
+    self->shm_metrics_pattern = strdup ((char*)zlist_next (params));
+    self->metric_polling = zactor_new (flexible_alert_metric_polling, params);
+    zactor_set_destructor (self->metric_polling, flexible_alert_metric_polling_destructor);
 
-    zpoller_t *poller = zpoller_new (mlm_client_msgpipe(self->mlm), pipe, NULL);
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe(self->mlm), pipe, self->metric_polling, NULL);
     while (!zsys_interrupted) {
-        void *which = zpoller_wait (poller, -1);
-        if (which == pipe) {
+        // recompute SHM patterns once bindings settle, or at least every second
+        int64_t timeout = self->metrics_expiry_time - zclock_mono ();
+        if (timeout < 0)
+            timeout = 0;
+        if (self->shm_patterns_dirty && timeout > SHM_PATTERNS_DELAY)
+            timeout = SHM_PATTERNS_DELAY;
+        if (zlist_size (self->alerts_pending) > 0 && timeout > self->alerts_deadline - zclock_mono ())
+            timeout = std::max<int64_t> (self->alerts_deadline - zclock_mono (), 0);
+        void *which = zpoller_wait (poller, (int) timeout);
+        if (self->shm_patterns_dirty &&
+            (zpoller_expired (poller) || zclock_mono () - self->shm_patterns_time >= 1000)) {
+            flexible_alert_shm_patterns (self);
+        }
+        if (zlist_size (self->alerts_pending) > 0 && zclock_mono () >= self->alerts_deadline)
+            flexible_alert_flush_alerts (self);
+        if (zclock_mono () >= self->metrics_expiry_time) {
+            flexible_alert_clean_metrics (self);
+            self->metrics_expiry_time = zclock_mono () + METRICS_EXPIRY_TICK;
+        }
+
+        if (which == self->metric_polling) {
+            flexible_alert_handle_metric_polling (self);
+        }
+        else if (which == pipe) {
             zmsg_t *msg = zmsg_recv (pipe);
             char *cmd = zmsg_popstr (msg);
             if (cmd) {
@@ -839,11 +2348,49 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                     zstr_free (&stream);
                     zstr_free (&pattern);
                 }
+                else if (streq (cmd, "LUAVMS")) {
+                    char *count = zmsg_popstr (msg);
+                    assert (count);
+                    rule_set_shared_vms (atoi (count));
+                    zstr_free (&count);
+                }
+                else if (streq (cmd, "LUABUDGET")) {
+                    char *instructions = zmsg_popstr (msg);
+                    char *memory = zmsg_popstr (msg);
+                    assert (instructions && memory);
+                    rule_set_lua_budget (atoi (instructions), (size_t) strtoul (memory, NULL, 10) * 1024);
+                    zstr_free (&instructions);
+                    zstr_free (&memory);
+                }
+                else if (streq (cmd, "ALERTSBATCH")) {
+                    char *count = zmsg_popstr (msg);
+                    char *delay = zmsg_popstr (msg);
+                    assert (count && delay);
+                    flexible_alert_flush_alerts (self);
+                    self->alerts_batch = atoi (count);
+                    self->alerts_batch_delay = atoi (delay);
+                    zstr_free (&count);
+                    zstr_free (&delay);
+                }
+                else if (streq (cmd, "EVALWORKERS")) {
+                    char *count = zmsg_popstr (msg);
+                    assert (count);
+                    flexible_alert_set_eval_workers (self, atoi (count));
+                    log_info ("SHM metrics evaluated by %d threads", self->eval_workers);
+                    zstr_free (&count);
+                }
+                else if (streq (cmd, "BYTECODE")) {
+                    char *dir = zmsg_popstr (msg);
+                    assert (dir);
+                    rule_set_bytecode_cache (dir);
+                    zstr_free (&dir);
+                }
                 else if (streq (cmd, "LOADRULES")) {
                     zstr_free (&ruledir);
                     ruledir = zmsg_popstr (msg);
                     assert (ruledir);
                     flexible_alert_load_rules (self, ruledir);
+                    flexible_alert_reindex (self);
                 }
                 else {
                     log_warning ("Unknown command.");
@@ -872,10 +2419,13 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                         0 == strcmp(address, FTY_PROTO_STREAM_LICENSING_ANNOUNCEMENTS)) {
                         // messages from FTY_PROTO_STREAM_METRICS are regular metrics
                         // LICENSING.EXPIRE: bmsg publish licensing-limitation licensing.expire 7 days
+                        bool licensing = 0 == strcmp(address, FTY_PROTO_STREAM_LICENSING_ANNOUNCEMENTS);
+                        self->metrics_received [licensing ? METRIC_STREAM_LICENSING : METRIC_STREAM_METRICS]++;
                         flexible_alert_handle_metric (self, &fmsg, false);
                     }
                     else if (0 == strcmp(address, FTY_PROTO_STREAM_METRICS_SENSOR)) {
                         // messages from FTY_PROTO_STREAM_METRICS_SENSORS are gpi sensors
+                        self->metrics_received [METRIC_STREAM_SENSOR]++;
                         if (is_gpi_metric (fmsg))
                             flexible_alert_handle_metric_sensor (self, &fmsg);
                     }
@@ -905,10 +2455,12 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                 }
                 else if (streq (cmd, "LIST")) {
                     // request: LIST/type/class
-                    // reply: LIST/type/class/name1/name2/...nameX
+                    // reply: LIST/type/class/rule1/rule2/...ruleX
+                    // request: LIST/type/class/option1/...optionN
+                    // reply: LIST/type/class/next/rule1/rule2/...ruleX
                     // reply: ERROR/reason
                     log_info("%s %s %s", cmd, p1, p2);
-                    reply = flexible_alert_list_rules (self, p1, p2);
+                    reply = flexible_alert_list_rules (self, p1, p2, msg);
                 }
                 else if (streq (cmd, "GET")) {
                     // request: GET/name
@@ -932,6 +2484,13 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                     log_info("%s %s", cmd, p1);
                     reply = flexible_alert_delete_rule (self, p1, ruledir);
                 }
+                else if (streq (cmd, "STATS")) {
+                    // request: STATS
+                    // request: STATS/count -- only count rules with most lua time
+                    // reply: STATS/statsjson
+                    log_info("%s %s", cmd, p1);
+                    reply = flexible_alert_stats (self, p1);
+                }
                 else {
                     log_warning("command '%s' not handled", cmd);
                 }
@@ -958,7 +2517,8 @@ flexible_alert_actor (zsock_t *pipe, void *args)
         }
     }
 
-    zactor_destroy(&metric_polling);
+    flexible_alert_flush_alerts (self);
+    zactor_destroy(&self->metric_polling);
     zstr_free (&ruledir);
     zpoller_destroy (&poller);
     flexible_alert_destroy (&self);
@@ -967,6 +2527,46 @@ flexible_alert_actor (zsock_t *pipe, void *args)
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+//  Add rule name consuming load.default to self. Selector is the json member
+//  choosing its assets, evaluation the body of main(v).
+static rule_t *
+s_test_add_rule (flexible_alert_t *self, const char *name, const char *selector, const char *evaluation)
+{
+    rule_t *rule = rule_new ();
+    char *json = zsys_sprintf ("{\"name\":\"%s\",\"metrics\":[\"load.default\"],%s,"
+        "\"evaluation\":\"function main(v) %s end\"}", name, selector, evaluation);
+    assert (rule_parse (rule, json) == 0);
+    zstr_free (&json);
+    zhash_update (self->rules, rule_name (rule), rule);
+    zhash_freefn (self->rules, rule_name (rule), rule_freefn);
+    return rule;
+}
+
+//  Flexible alert with count rules <prefix>0, <prefix>1, ... added by
+//  s_test_add_rule. Alerts are batched, so that nothing is sent on the
+//  unconnected client.
+static flexible_alert_t *
+s_test_fixture (const char *prefix, int count, const char *selector, const char *evaluation)
+{
+    flexible_alert_t *self = flexible_alert_new ();
+    self->alerts_batch = 1000;
+    for (int i = 0; i < count; i++) {
+        char *name = zsys_sprintf ("%s%d", prefix, i);
+        s_test_add_rule (self, name, selector, evaluation);
+        zstr_free (&name);
+    }
+    flexible_alert_reindex (self);
+    return self;
+}
+
+static int
+s_stats_count (const char *locator, const char *value, void *data)
+{
+    (void) locator; (void) value;
+    (*(int *) data)++;
+    return 0;
+}
+
 void
 flexible_alert_test (bool verbose)
 {
@@ -1150,7 +2750,7 @@ flexible_alert_test (bool verbose)
     }
     {
         // test DELETE
-        printf ("   #3 DELETE ");
+        printf ("\t#5 DELETE ");
 
         zmsg_t *msg = zmsg_new();
         zmsg_addstr (msg, "DELETE");
@@ -1179,6 +2779,448 @@ flexible_alert_test (bool verbose)
     zactor_destroy (&fs);
     //destroy malamute
     zactor_destroy (&malamute);
+
+    //  Rules directory is loaded by worker threads
+    {
+        printf ("\t#6 Load rules ");
+        self = flexible_alert_new ();
+        char *rules_dir = zsys_sprintf ("%s/rules", SELFTEST_DIR_RO);
+        flexible_alert_load_rules (self, rules_dir);
+        zstr_free (&rules_dir);
+        assert (zhash_lookup (self->rules, "ups"));
+        assert (zhash_lookup (self->rules, "threshold"));
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  LIST options narrow and page the reply
+    {
+        printf ("\t#7 List filters ");
+        self = flexible_alert_new ();
+        char *rules_dir = zsys_sprintf ("%s/rules", SELFTEST_DIR_RO);
+        flexible_alert_load_rules (self, rules_dir);
+        zstr_free (&rules_dir);
+        flexible_alert_reindex (self);
+
+        zmsg_t *options = zmsg_new ();
+        zmsg_addstr (options, "name=sts-");
+        zmsg_addstr (options, "limit=2");
+        zmsg_t *reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        assert (zmsg_size (reply) == 6);
+        char *item = zmsg_popstr (reply);
+        assert (streq (item, "LIST"));
+        zstr_free (&item);
+        for (int i = 0; i < 2; i++) {
+            item = zmsg_popstr (reply);
+            zstr_free (&item);
+        }
+        char *next = zmsg_popstr (reply);
+        assert (streq (next, "sts-preferred-source"));
+        item = zmsg_popstr (reply);
+        assert (strstr (item, "\"sts-frequency\""));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        options = zmsg_new ();
+        zmsg_addstr (options, "name=sts-");
+        zmsg_addstrf (options, "after=%s", next);
+        zmsg_addstr (options, "limit=2");
+        reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        zstr_free (&next);
+        assert (zmsg_size (reply) == 5);
+        for (int i = 0; i < 3; i++) {
+            item = zmsg_popstr (reply);
+            zstr_free (&item);
+        }
+        next = zmsg_popstr (reply);
+        assert (streq (next, ""));
+        zstr_free (&next);
+        item = zmsg_popstr (reply);
+        assert (strstr (item, "\"sts-voltage\""));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        options = zmsg_new ();
+        zmsg_addstr (options, "metric=status.ups");
+        reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        assert (zmsg_size (reply) == 5);
+        zmsg_destroy (&reply);
+
+        options = zmsg_new ();
+        zmsg_addstr (options, "metric=no.such.metric");
+        reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        assert (zmsg_size (reply) == 4);
+        zmsg_destroy (&reply);
+
+        options = zmsg_new ();
+        zmsg_addstr (options, "asset_type=sts");
+        reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        assert (zmsg_size (reply) == 7);
+        zmsg_destroy (&reply);
+
+        options = zmsg_new ();
+        zmsg_addstr (options, "bogus");
+        reply = flexible_alert_list_rules (self, (char *) "all", (char *) "", options);
+        zmsg_destroy (&options);
+        item = zmsg_popstr (reply);
+        assert (streq (item, "ERROR"));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  Metric index follows asset and rule changes
+    {
+        printf ("\t#8 Metric index ");
+        self = flexible_alert_new ();
+        char *rule_file = zsys_sprintf ("%s/rules/ups.rule", SELFTEST_DIR_RO);
+        assert (flexible_alert_load_one_rule (self, rule_file));
+        zstr_free (&rule_file);
+        flexible_alert_reindex (self);
+        assert (zhash_lookup (self->match_rules, "g:all-upses"));
+        assert (zhash_lookup (self->match_rules, "q:status.ups"));
+        assert (zhash_size (self->match_rules) == 2);
+
+        fty_proto_t *assetmsg = fty_proto_new (FTY_PROTO_ASSET);
+        fty_proto_set_name (assetmsg, "ups-1");
+        fty_proto_set_operation (assetmsg, FTY_PROTO_ASSET_OP_UPDATE);
+        fty_proto_ext_insert (assetmsg, "group.1", "all-upses");
+        flexible_alert_handle_asset (self, assetmsg);
+
+        zlist_t *rules = (zlist_t *) zhash_lookup (self->metric_rules, "status.ups@ups-1");
+        assert (rules && zlist_size (rules) == 1);
+        assert (streq (rule_name ((rule_t *) zlist_first (rules)), "ups"));
+        assert (!zhash_lookup (self->metric_rules, "load.default@ups-1"));
+
+        self->shm_assets_pattern = strdup ("ups-.*");
+        self->shm_metrics_pattern = strdup (".*");
+        flexible_alert_shm_patterns (self);
+        assert (!self->shm_patterns_dirty);
+        assert (streq (self->shm_assets_derived, "^(ups-1)$"));
+        assert (streq (self->shm_metrics_derived, "^(status\\.ups)(\\..*)?$"));
+        // invalid configured pattern is used as it is
+        zstr_free (&self->shm_assets_pattern);
+        self->shm_assets_pattern = strdup ("ups-(");
+        flexible_alert_shm_patterns (self);
+        assert (streq (self->shm_assets_derived, "ups-("));
+        assert (streq (self->shm_metrics_derived, "^(status\\.ups)(\\..*)?$"));
+
+        zhash_delete (self->rules, "ups");
+        flexible_alert_reindex (self);
+        assert (!zhash_lookup (self->metric_rules, "status.ups@ups-1"));
+        assert (!zhash_lookup (self->assets, "ups-1"));
+
+        // rule added later is bound to known asset
+        rule_file = zsys_sprintf ("%s/rules/ups.rule", SELFTEST_DIR_RO);
+        assert (flexible_alert_load_one_rule (self, rule_file));
+        zstr_free (&rule_file);
+        flexible_alert_reindex (self);
+        assert (zhash_lookup (self->metric_rules, "status.ups@ups-1"));
+
+        flexible_alert_shm_patterns (self);
+        assert (!self->shm_patterns_dirty);
+        fty_proto_set_operation (assetmsg, FTY_PROTO_ASSET_OP_DELETE);
+        flexible_alert_handle_asset (self, assetmsg);
+        assert (zhash_size (self->metric_rules) == 0);
+        // deleted asset is not polled anymore
+        assert (self->shm_patterns_dirty);
+        flexible_alert_shm_patterns (self);
+        assert (streq (self->shm_assets_derived, "") && streq (self->shm_metrics_derived, ""));
+
+        fty_proto_destroy (&assetmsg);
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  Alerts are published on state transitions
+    {
+        printf ("\t#9 Alert transitions ");
+        self = flexible_alert_new ();
+        rule_t *rule = rule_new ();
+        assert (rule_parse (rule, "{\"name\":\"transition\",\"evaluation\":\"function main() return OK, '' end\"}") == 0);
+
+        assert (flexible_alert_alert_changed (self, rule, "ups-1", 0, "ok", 60));
+        assert (!flexible_alert_alert_changed (self, rule, "ups-1", 0, "ok", 60));
+        assert (flexible_alert_alert_changed (self, rule, "ups-2", 0, "ok", 60));
+        assert (flexible_alert_alert_changed (self, rule, "ups-1", 1, "ok", 60));
+        assert (flexible_alert_alert_changed (self, rule, "ups-1", 1, "high", 60));
+        assert (self->alerts_suppressed == 1);
+        // refreshed once half of the ttl is over
+        assert (flexible_alert_alert_changed (self, rule, "ups-1", 1, "high", 0));
+
+        // deleted asset or rule comes back with a fresh state
+        flexible_alert_forget_alerts (self, NULL, "ups-2");
+        assert (zhash_size (self->alerts) == 1);
+        assert (flexible_alert_alert_changed (self, rule, "ups-2", 0, "ok", 60));
+        flexible_alert_forget_alerts (self, "transitio", NULL);
+        assert (zhash_size (self->alerts) == 2);
+        flexible_alert_forget_alerts (self, "transition", NULL);
+        assert (zhash_size (self->alerts) == 0);
+
+        rule_destroy (&rule);
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  Batched alerts keep the latest state of each rule and asset
+    {
+        printf ("\t#10 Alert batching ");
+        self = flexible_alert_new ();
+        self->alerts_batch = 10;
+        self->alerts_batch_delay = 100;
+        const char *keys[] = { "ups@ups-1", "ups@ups-2", "ups@ups-1" };
+        const char *topics[] = { "ups/WARNING@ups-1", "ups/OK@ups-2", "ups/OK@ups-1" };
+        for (int i = 0; i < 3; i++) {
+            zmsg_t *alert = zmsg_new ();
+            flexible_alert_queue_alert (self, keys[i], topics[i], &alert);
+            assert (!alert);
+        }
+        assert (zlist_size (self->alerts_pending) == 2);
+        pending_alert_t *pending = (pending_alert_t *) zlist_first (self->alerts_pending);
+        assert (streq (pending->topic, "ups/OK@ups-1"));
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  SHM change detection
+    {
+        printf ("\t#11 SHM change detection ");
+        zhashx_t *samples = zhashx_new ();
+        zhashx_set_destructor (samples, shm_sample_destroy);
+        fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+        fty_proto_set_name (metric, "ups-1");
+        fty_proto_set_type (metric, "status.ups");
+        fty_proto_set_value (metric, "64");
+        fty_proto_set_time (metric, 1000);
+
+        assert (shm_sample_changed (samples, metric, 1));
+        assert (!shm_sample_changed (samples, metric, 2));
+        fty_proto_set_value (metric, "65");
+        assert (shm_sample_changed (samples, metric, 3));
+        fty_proto_set_time (metric, 1005);
+        assert (shm_sample_changed (samples, metric, 4));
+        assert (!shm_sample_changed (samples, metric, 5));
+
+        shm_samples_sweep (samples, 5);
+        assert (zhashx_size (samples) == 1);
+        shm_samples_sweep (samples, 6);
+        assert (zhashx_size (samples) == 0);
+
+        fty_proto_destroy (&metric);
+        zhashx_destroy (&samples);
+        printf ("OK\n");
+    }
+
+    //  Metric cache expiry
+    {
+        printf ("\t#12 Metric cache expiry ");
+        self = flexible_alert_new ();
+        int64_t now = (int64_t) time (NULL);
+
+        fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+        fty_proto_set_time (metric, now - 100);
+        fty_proto_set_ttl (metric, 10);
+        fty_proto_set_value (metric, "64");
+        flexible_alert_cache_metric (self, "status.ups@ups-1", metric);
+        fty_proto_set_value (metric, "a value too long to be stored inline");
+        flexible_alert_cache_metric (self, "load.default@ups-1", metric);
+        // refreshed before expiry, must survive
+        fty_proto_set_time (metric, now);
+        fty_proto_set_ttl (metric, 60);
+        fty_proto_set_value (metric, "42");
+        // same topic, short value, later expiry: no path which may allocate
+        uint64_t slow = self->metrics_cache_slow;
+        flexible_alert_cache_metric (self, "load.default@ups-1", metric);
+        assert (self->metrics_cache_slow == slow);
+        fty_proto_destroy (&metric);
+        assert (self->metrics_expiry->size () == 2);
+
+        flexible_alert_clean_metrics (self);
+        assert (!metric_cache_lookup (self->metrics, "status.ups@ups-1"));
+        cached_metric_t *cached = metric_cache_lookup (self->metrics, "load.default@ups-1");
+        assert (cached && cached->ttl == 60 && streq (cached_metric_value (cached), "42"));
+        assert (self->metrics_expiry->size () == 1);
+        assert (self->metrics_expiry->top ().first == now + 60);
+        assert (self->metrics->size == 1);
+
+        // table grows and reuses deleted slots, long topics are kept aside
+        metric_cache_t *cache = self->metrics;
+        char topic[128];
+        bool allocated;
+        for (int i = 0; i < 1000; i++) {
+            snprintf (topic, sizeof (topic), "%s.input@ups-%d", i % 10 ? "load" : "a.quantity.too.long.to.be.stored.inline", i);
+            cached = metric_cache_insert (cache, topic, &allocated);
+            cached_metric_set_value (cached, topic);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+            snprintf (topic, sizeof (topic), "%s.input@ups-%d", i % 10 ? "load" : "a.quantity.too.long.to.be.stored.inline", i);
+            metric_cache_delete (cache, metric_cache_lookup (cache, topic));
+        }
+        assert (cache->size == 501);
+        size_t capacity = cache->capacity;
+        for (int round = 0; round < 10; round++) {
+            for (int i = 0; i < 1000; i += 2) {
+                snprintf (topic, sizeof (topic), "status.ups@ups-%d", i);
+                metric_cache_insert (cache, topic, &allocated);
+                metric_cache_delete (cache, metric_cache_lookup (cache, topic));
+            }
+        }
+        assert (cache->capacity == capacity);
+        assert (cache->used * 4 <= cache->capacity * 3);
+        for (int i = 0; i < 1000; i++) {
+            snprintf (topic, sizeof (topic), "%s.input@ups-%d", i % 10 ? "load" : "a.quantity.too.long.to.be.stored.inline", i);
+            cached = metric_cache_lookup (cache, topic);
+            assert (i % 2 ? cached && streq (cached_metric_value (cached), topic) : !cached);
+        }
+        assert (metric_cache_lookup (cache, "load.default@ups-1"));
+
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  Batch evaluated by several threads gives one alert per rule and asset
+    {
+        printf ("\t#13 Parallel evaluation ");
+        self = s_test_fixture ("r", 8, "\"groups\":[\"all\"]",
+            "if tonumber(v) > 50 then return WARNING, NAME .. ' ' .. v end return OK, ''");
+        flexible_alert_set_eval_workers (self, 4);
+
+        std::vector<fty_proto_t *> metrics;
+        for (int i = 1; i <= 4; i++) {
+            char *name = zsys_sprintf ("ups-%d", i);
+            fty_proto_t *assetmsg = fty_proto_new (FTY_PROTO_ASSET);
+            fty_proto_set_name (assetmsg, name);
+            fty_proto_set_operation (assetmsg, FTY_PROTO_ASSET_OP_UPDATE);
+            fty_proto_ext_insert (assetmsg, "group.1", "all");
+            flexible_alert_handle_asset (self, assetmsg);
+            fty_proto_destroy (&assetmsg);
+
+            fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+            fty_proto_set_name (metric, name);
+            fty_proto_set_type (metric, "load.default");
+            fty_proto_set_ttl (metric, 60);
+            fty_proto_set_value (metric, "60");
+            metrics.push_back (metric);
+            zstr_free (&name);
+        }
+        // newer value of the same metric in the batch wins
+        fty_proto_t *metric = fty_proto_dup (metrics[0]);
+        fty_proto_set_value (metric, "70");
+        metrics.push_back (metric);
+
+        flexible_alert_handle_metrics (self, metrics);
+        assert (zlist_size (self->alerts_pending) == 32);
+        pending_alert_t *pending = (pending_alert_t *) zhash_lookup (self->alerts_pending_idx, "r3@ups-1");
+        assert (pending && streq (pending->topic, "r3/WARNING@ups-1"));
+        alert_state_t *state = (alert_state_t *) zhash_lookup (self->alerts, "r3@ups-1");
+        assert (state && streq (state->message, "ups-1 70"));
+
+        // threads stay for the next batch, long messages are kept whole
+        s_test_add_rule (self, "long", "\"groups\":[\"all\"]", "return WARNING, string.rep ('x', 2000) .. v");
+        flexible_alert_reindex (self);
+        for (auto &item : metrics)
+            fty_proto_set_value (item, "80");
+        flexible_alert_handle_metrics (self, metrics);
+        state = (alert_state_t *) zhash_lookup (self->alerts, "r3@ups-1");
+        assert (state && streq (state->message, "ups-1 80"));
+        state = (alert_state_t *) zhash_lookup (self->alerts, "long@ups-2");
+        assert (state && strlen (state->message) == 2002 && streq (state->message + 2000, "80"));
+
+        for (auto &item : metrics)
+            fty_proto_destroy (&item);
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  STATS reports counters and rules with most lua time first
+    {
+        printf ("\t#14 Stats ");
+        self = s_test_fixture ("s", 2, "\"assets\":[\"ups-1\"]", "return OK, ''");
+        fty_proto_t *assetmsg = fty_proto_new (FTY_PROTO_ASSET);
+        fty_proto_set_name (assetmsg, "ups-1");
+        fty_proto_set_operation (assetmsg, FTY_PROTO_ASSET_OP_UPDATE);
+        flexible_alert_handle_asset (self, assetmsg);
+        fty_proto_destroy (&assetmsg);
+
+        fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+        fty_proto_set_name (metric, "ups-1");
+        fty_proto_set_type (metric, "load.default");
+        fty_proto_set_ttl (metric, 60);
+        fty_proto_set_value (metric, "10");
+        flexible_alert_handle_metric (self, &metric, false);
+        fty_proto_set_type (metric, "load.input");
+        flexible_alert_handle_metric (self, &metric, false);
+        fty_proto_destroy (&metric);
+        assert (self->metrics_handled == 1);
+        assert (self->metrics_dropped == 1);
+        assert (self->evaluations == 2);
+
+        zmsg_t *reply = flexible_alert_stats (self, NULL);
+        assert (zmsg_size (reply) == 2);
+        char *item = zmsg_popstr (reply);
+        assert (streq (item, "STATS"));
+        zstr_free (&item);
+        char *json = zmsg_popstr (reply);
+        int values = 0;
+        assert (vsjson_parse (json, s_stats_count, &values, true) == 0);
+        assert (values > 20);
+        assert (strstr (json, "\"dropped\":1,"));
+        assert (strstr (json, "\"cached\":1,"));
+        assert (strstr (json, "\"age_ms\":null"));
+        assert (strstr (json, "\"name\":\"s0\",\"evaluations\":1,\"errors\":0,"));
+        assert (strstr (json, "\"name\":\"s1\""));
+        zstr_free (&json);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_stats (self, "1");
+        item = zmsg_popstr (reply);
+        zstr_free (&item);
+        json = zmsg_popstr (reply);
+        assert (strstr (json, "\"evaluations\":1,") && !strstr (json, "},{"));
+        zstr_free (&json);
+        zmsg_destroy (&reply);
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
+    //  Rules going over their lua budget are quarantined
+    {
+        printf ("\t#15 Quarantine ");
+        self = s_test_fixture ("endless", 1, "\"assets\":[\"ups-1\"]", "while true do end");
+        rule_set_lua_budget (10000, RULE_LUA_MEMORY);
+        rule_t *rule = (rule_t *) zhash_lookup (self->rules, "endless0");
+
+        fty_proto_t *metric = fty_proto_new (FTY_PROTO_METRIC);
+        fty_proto_set_ttl (metric, 60);
+        fty_proto_set_value (metric, "10");
+        flexible_alert_cache_metric (self, "load.default@ups-1", metric);
+        fty_proto_destroy (&metric);
+        for (int i = 0; i < RULE_BUDGET_STRIKES + 2; i++)
+            flexible_alert_evaluate (self, rule, "ups-1", NULL);
+        assert (rule_quarantined (rule));
+        assert (self->evaluations == RULE_BUDGET_STRIKES);
+        // lua context went away with the last evaluation
+        assert (rule_lua_memory (rule) == 0);
+
+        zmsg_t *reply = flexible_alert_stats (self, NULL);
+        char *item = zmsg_popstr (reply);
+        zstr_free (&item);
+        char *json = zmsg_popstr (reply);
+        assert (strstr (json, "\"budget_exceeded\":3,\"quarantined\":true}],\"quarantined\":1}"));
+        zstr_free (&json);
+        zmsg_destroy (&reply);
+        rule_set_lua_budget (RULE_LUA_INSTRUCTIONS, RULE_LUA_MEMORY);
+        flexible_alert_destroy (&self);
+        printf ("OK\n");
+    }
+
     fty_shm_delete_test_dir();
 
     // release audit context
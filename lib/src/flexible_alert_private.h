@@ -0,0 +1,209 @@
+/*  =========================================================================
+    flexible_alert_private - Internals of flexible_alert
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+//  Not part of the library API. Shared by flexible_alert.cc and the
+//  evaluation pipeline benchmark in tests/, which drives the class without
+//  the actor.
+
+#ifndef FLEXIBLE_ALERT_PRIVATE_H_INCLUDED
+#define FLEXIBLE_ALERT_PRIVATE_H_INCLUDED
+
+#include "fty_alert_flexible_classes.h"
+#include <queue>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// evaluation message kept in the job itself, longer ones are duplicated
+#define EVAL_MESSAGE_MAX 1024
+
+//  Sources of metrics counted in STATS
+enum {
+    METRIC_STREAM_METRICS,
+    METRIC_STREAM_SENSOR,
+    METRIC_STREAM_LICENSING,
+    METRIC_STREAM_SHM,
+    METRIC_STREAMS
+};
+
+//  Cached metric, only what rule evaluation needs. Topic and short values
+//  are kept in the slot itself.
+
+#define CACHED_METRIC_TOPIC 48
+#define CACHED_METRIC_INLINE 24
+
+typedef struct {
+    uint64_t hash;              // of topic, 0 = free slot, 1 = deleted slot
+    uint64_t time;
+    uint32_t ttl;
+    char *topic_heap;           // topic too long for topic_buf
+    char *value_heap;           // value too long for value_buf
+    char topic_buf [CACHED_METRIC_TOPIC];
+    char value_buf [CACHED_METRIC_INLINE];
+} cached_metric_t;
+
+//  Metric cache, flat open addressing table of "quantity@asset" topics with
+//  linear probing. Slots move when the table grows: pointers into it stay
+//  valid only until the next metric is cached.
+
+typedef struct {
+    cached_metric_t *slots;
+    size_t capacity;            // power of two, 0 until first metric
+    size_t size;                // cached metrics
+    size_t used;                // cached metrics and deleted slots
+} metric_cache_t;
+
+//  Metric cache expiry queue, earliest expiry first. Every cached topic has
+//  at least one entry; entries are checked against the cached metric when
+//  they come due, so refreshed metrics are simply rescheduled.
+typedef std::pair<int64_t, std::string> metric_expiry_t;
+typedef std::priority_queue<metric_expiry_t, std::vector<metric_expiry_t>, std::greater<metric_expiry_t>> metric_expiry_queue_t;
+
+//  One evaluation of rule for asset. Params are borrowed from the metric
+//  cache, which must not change between prepare and finish. Message is
+//  borrowed from the lua state, unless evaluations run between run and
+//  finish of the job: then it is copied.
+
+typedef struct {
+    rule_t *rule;
+    const char *assetname;
+    const char *ename;
+    const char *params [RULE_MAX_PARAMS];
+    int count;
+    int ttl;
+    bool missing;               // some metric is not cached
+    bool runnable;              // rule compiled, evaluation can run
+    bool valid;                 // prepared, to be finished
+    bool copy_message;          // other evaluations run before finish
+    int result;
+    const char *message;        // lua state, message_buf or message_heap
+    char *message_heap;         // copy of message too long for message_buf
+    char message_buf[EVAL_MESSAGE_MAX];
+    char audit[1024];
+} eval_job_t;
+
+//  Threads evaluating SHM batches, started by EVALWORKERS. Jobs and parts
+//  are kept between batches. Thread w runs parts[w] of every batch, parts[0]
+//  runs on the actor thread.
+
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable wake;       // new batch or stop
+    std::condition_variable done;       // running dropped to zero
+    std::vector<std::thread> threads;
+    std::vector<eval_job_t> jobs;
+    std::vector<std::vector<eval_job_t *>> parts;
+    uint64_t batch;                     // incremented for every batch
+    size_t running;                     // threads still running the batch
+    bool stop;
+} eval_pool_t;
+
+//  Structure of our class
+
+struct _flexible_alert_t {
+    zhash_t *rules;
+    zhash_t *assets;
+    metric_cache_t *metrics;    // "quantity@asset" -> cached_metric_t
+    zhash_t *asset_infos;       // asset name -> asset_info_t of every active asset
+    zhash_t *metric_rules;      // "quantity@asset" -> zlist_t of rule_t* consuming it
+    zhash_t *match_rules;       // "a:name", "g:group", "m:model", "t:type", "q:metric" -> zlist_t of rule_t*
+    metric_expiry_queue_t *metrics_expiry; // expiry of cached metrics
+    int64_t metrics_expiry_time; // next expiry tick
+    uint64_t metrics_handled;   // count of metrics consumed by some rule
+    uint64_t metrics_cache_slow; // metric cache updates which may have allocated
+    zhash_t *alerts;            // "rule@asset" -> alert_state_t last published
+    uint64_t alerts_suppressed; // count of unchanged alerts not published
+    uint64_t alerts_published;  // count of alerts sent
+    uint64_t evaluations;       // count of rule evaluations with all metrics
+    uint64_t metrics_received [METRIC_STREAMS]; // count of metrics per source
+    uint64_t metrics_dropped;   // count of metrics no rule consumes
+    uint64_t metrics_expired;   // count of cached metrics dropped on expiry
+    int64_t shm_poll_time;      // when last SHM batch was handled, 0 = never
+    int64_t shm_poll_read_us;   // duration of last SHM read
+    int64_t shm_poll_handle_us; // duration of last SHM batch evaluation
+    int shm_poll_metrics;       // metrics of last SHM batch
+    int shm_poll_unchanged;     // unchanged metrics skipped from last SHM batch
+    int alerts_batch;           // flush pending alerts at this count, 0 = no batching
+    int alerts_batch_delay;     // flush pending alerts after this delay (ms)
+    zlist_t *alerts_pending;    // pending_alert_t waiting for flush, in order
+    zhash_t *alerts_pending_idx; // "rule@asset" -> pending_alert_t
+    int64_t alerts_deadline;    // when pending alerts must be flushed
+    int eval_workers;           // threads evaluating SHM batches, 1 = actor only
+    eval_pool_t *eval_pool;     // worker threads when eval_workers > 1
+    mlm_client_t *mlm;
+    zactor_t *metric_polling;   // SHM polling actor
+    uint64_t shm_changes;       // count of rules/bindings changes
+    uint64_t shm_resync;        // shm_changes when last RESYNC was sent
+    bool shm_resync_pending;    // RESYNC sent, complete batch not received yet
+    char *shm_assets_pattern;   // configured SHM patterns, upper bound for
+    char *shm_metrics_pattern;  // patterns derived from the metric index
+    char *shm_assets_derived;   // patterns last sent to SHM polling actor
+    char *shm_metrics_derived;
+    bool shm_patterns_dirty;    // metric index changed since last derivation
+    int64_t shm_patterns_time;  // when patterns were last derived
+};
+
+typedef struct _flexible_alert_t flexible_alert_t;
+
+//  Create a new flexible_alert
+FTY_ALERT_FLEXIBLE_PRIVATE flexible_alert_t *
+    flexible_alert_new (void);
+
+//  Destroy the flexible_alert
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_destroy (flexible_alert_t **self_p);
+
+//  Load every .rule file of path
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_load_rules (flexible_alert_t *self, const char *path);
+
+//  Rebuild rule indexes and asset bindings after rules changed
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_reindex (flexible_alert_t *self);
+
+//  Derive SHM patterns from the metric index
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_shm_patterns (flexible_alert_t *self);
+
+//  Set count of threads evaluating SHM batches
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_set_eval_workers (flexible_alert_t *self, int workers);
+
+//  Handle asset message, binds rules to the asset
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_handle_asset (flexible_alert_t *self, fty_proto_t *ftymsg);
+
+//  Evaluate one batch read from SHM and publish its alerts, destroys batch
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    flexible_alert_handle_shm_batch (flexible_alert_t *self, fty::shm::shmMetrics *result);
+
+//  Destructor of SHM samples kept between polls
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    shm_sample_destroy (void **item_p);
+
+//  Read metrics matching patterns from SHM. Unchanged ones are destroyed,
+//  leaving NULL in the returned batch. Caller owns the batch.
+FTY_ALERT_FLEXIBLE_PRIVATE fty::shm::shmMetrics *
+    shm_poll (zhashx_t *samples, const char *assets_pattern, const char *metrics_pattern, uint64_t poll, int *skipped);
+
+#endif
@@ -47,6 +47,18 @@ struct _rule_t {
     zhashx_t *variables;        //  lua context global variables
     char *evaluation;
     lua_State *lua;
+    int lua_vm;                 // index of shared lua VM, -1 when private
+    int lua_env;                // registry ref of environment in shared VM
+    char *lua_name;             // NAME and INAME currently set in lua
+    char *lua_iname;
+    char *json_cache;           // compact json in envelope, NULL when stale
+    size_t json_cache_size;
+    uint64_t evaluations;       // count of lua calls of main
+    uint64_t errors;            // lua calls which failed
+    uint64_t lua_usecs;         // time spent in lua calls
+    uint32_t lua_histogram [RULE_HISTOGRAM_BUCKETS];    // see s_histogram_bucket
+    uint64_t budget_exceeded;   // lua calls stopped by the budget
+    bool quarantined;           // not evaluated anymore, see s_rule_over_budget
     struct {
         char *action;
         char *act_asset;
@@ -55,6 +67,67 @@ struct _rule_t {
 };
 
 
+//  Lua call times are counted in buckets of 4 per power of 2 of microseconds,
+//  exact below 8 us, so that percentiles are within 25 %.
+
+static int
+s_histogram_bucket (uint64_t usecs)
+{
+    if (usecs < 4) return (int) usecs;
+    int log = 63 - __builtin_clzll (usecs);
+    int bucket = (log - 1) * 4 + (int) ((usecs >> (log - 2)) & 3);
+    return bucket < RULE_HISTOGRAM_BUCKETS ? bucket : RULE_HISTOGRAM_BUCKETS - 1;
+}
+
+//  Highest value counted in bucket
+static uint64_t
+s_histogram_upper (int bucket)
+{
+    if (bucket < 4) return bucket;
+    return ((uint64_t) (bucket % 4 + 5) << (bucket / 4 - 1)) - 1;
+}
+
+//  Shared lua VMs. When enabled, rules are compiled into the least used VM,
+//  each one in its own environment table falling back to VM globals. Only
+//  globals the rule assigns are its own: library tables like string or math
+//  are shared, a rule modifying them affects all rules of the VM.
+
+static struct {
+    lua_State *lua;
+    int rules;                  // count of rules compiled into this VM
+} s_vms [RULE_MAX_VMS];
+static int s_vms_count = 0;
+
+//  Directory with precompiled evaluation chunks, NULL when disabled
+static char *s_bytecode_dir = NULL;
+
+//  Budget of one lua call of a rule, 0 = unlimited. Memory is the cap of
+//  the heap of a private VM, shared VMs get it once per rule they hold.
+static int s_lua_instructions = RULE_LUA_INSTRUCTIONS;
+static size_t s_lua_memory = RULE_LUA_MEMORY;
+
+//  Heap accounting of a lua VM, user data of its allocator. The cap only
+//  applies while a rule call runs, so that pushing params or globals can't
+//  fail outside of a protected call.
+typedef struct {
+    size_t used;                // bytes allocated by the VM
+    size_t limit;               // cap of used, 0 = none
+    bool enforced;              // rule call is running
+    int exceeded;               // RULE_BUDGET_* hit by the running call
+} rule_lua_heap_t;
+
+//  Envelope expected by UI around the rule json
+#define RULE_JSON_ENVELOPE_HEAD "{\"flexible\": "
+#define RULE_JSON_ENVELOPE_TAIL " }"
+
+//  Rule content changed, drop the serialized form
+static void
+s_rule_json_invalidate (rule_t *self)
+{
+    zstr_free (&self->json_cache);
+    self->json_cache_size = 0;
+}
+
 static
 int string_comparefn (void *i1, void *i2)
 {
@@ -70,6 +143,8 @@ rule_new (void)
     rule_t *self = (rule_t *) zmalloc (sizeof (rule_t));
     assert (self);
     memset(self, 0, sizeof(*self));
+    self->lua_vm = -1;
+    self->lua_env = LUA_NOREF;
 
     //  Initialize class properties here
     self -> metrics = zlist_new ();
@@ -110,6 +185,7 @@ void rule_add_result_action (rule_t *self, const char *result, const char *actio
 {
     if (!self || !result) return;
 
+    s_rule_json_invalidate (self);
     zlist_t *list = (zlist_t *) zhash_lookup (self->result_actions, result);
     if (!list) {
         list = zlist_new ();
@@ -122,168 +198,275 @@ void rule_add_result_action (rule_t *self, const char *result, const char *actio
 }
 
 //  --------------------------------------------------------------------------
-//  Rule loading callback
+//  Rule loading callbacks, one per top level field of the rule schema.
+//  locator is the full path (without the "flexible/" envelope), path is
+//  what follows the field name and its separator.
+
+typedef int (rule_json_field_fn) (rule_t *self, const char *locator, const char *path, const char *value, size_t len);
+
+static void
+s_rule_json_set (char **field, const char *value, size_t len)
+{
+    zstr_free (field);
+    *field = vsjson_decode_nstring (value, len);
+}
+
+static void
+s_rule_json_append (zlist_t *list, const char *value, size_t len, bool skip_empty)
+{
+    char *item = vsjson_decode_nstring (value, len);
+    if (item && !(skip_empty && item[0] == 0))
+        zlist_append (list, item);
+    zstr_free (&item);
+}
 
 static int
-rule_json_callback (const char *locator, const char *value, void *data)
+s_rule_json_name (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
 {
-    if (!data) return 1;
+    if (*path == 0) s_rule_json_set (&self->name, value, len);
+    return 0;
+}
 
-    rule_t *self = (rule_t *) data;
+static int
+s_rule_json_description (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    if (*path == 0) s_rule_json_set (&self->description, value, len);
+    return 0;
+}
 
-    // incomming json can be encapsulated with { "flexible": ... } envelope
-    const char *mylocator = locator;
-    if (strncmp (locator, "flexible/",9) == 0) mylocator = &locator[9];
+static int
+s_rule_json_logical_asset (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    if (*path == 0) s_rule_json_set (&self->logical_asset, value, len);
+    return 0;
+}
 
-    if (streq (mylocator, "name")) {
-        zstr_free (&self -> name);
-        self -> name = vsjson_decode_string (value);
-    }
-    else if (streq (mylocator, "description")) {
-        zstr_free (&self -> description);
-        self -> description = vsjson_decode_string (value);
-    }
-    else if (streq (mylocator, "logical_asset")) {
-        zstr_free (&self -> logical_asset);
-        self -> logical_asset = vsjson_decode_string (value);
-    }
-    else if (strncmp (mylocator, "metrics/", 7) == 0) {
-        char *metric = vsjson_decode_string (value);
-        if (metric) zlist_append (self -> metrics, metric);
-        zstr_free (&metric);
-    }
-    else if (strncmp (mylocator, "assets/", 7) == 0) {
-        char *asset = vsjson_decode_string (value);
-        if (asset) zlist_append (self -> assets, asset);
-        zstr_free (&asset);
-    }
-    else if (strncmp (mylocator, "groups/", 7) == 0) {
-        char *group = vsjson_decode_string (value);
-        if (group) zlist_append (self -> groups, group);
-        zstr_free (&group);
-    }
-    else if (strncmp (mylocator, "models/", 7) == 0) {
-        char *model = vsjson_decode_string (value);
-        if (model && strlen (model) > 0)
-            zlist_append (self->models, model);
-        zstr_free (&model);
-    }
-    else if (strncmp (mylocator, "types/", 6) == 0) {
-        char *type = vsjson_decode_string (value);
-        if (type && strlen (type) > 0)
-            zlist_append (self->types, type);
-        zstr_free (&type);
-    }
-    else if (strncmp (mylocator, "results/", 8) == 0) {
-        const char *end = strrchr (mylocator, '/') + 1;
-        const char *prev = end - strlen ("action/");
-        // OLD FORMAT:
-        // results/high_critical/action/0
-        if (*end >= '0' && *end <= '9' && strncmp (prev, "action", strlen("action")) == 0) {
-            zstr_free(&self->parser.action);
-            self->parser.action = vsjson_decode_string (value);
-        }
-        // NEW FORMAT:
-        // results/high_critical/action/0/action
-        // results/high_critical/action/0/asset for action == "GPO_INTERACTION"
-        // results/high_critical/action/0/mode  ditto
-        else if (streq (end, "action")) {
-            zstr_free(&self->parser.action);
-            self->parser.action = vsjson_decode_string (value);
-        }
-        else if (streq (end, "asset")) {
-            zstr_free(&self->parser.act_asset);
-            self->parser.act_asset = vsjson_decode_string (value);
-        }
-        else if (streq (end, "mode")) {
-            zstr_free(&self->parser.act_mode);
-            self->parser.act_mode = vsjson_decode_string (value);
-        }
-        else if (streq (end, "severity") || streq (end, "description")) {
-            // action == AUTOMATION
-            // automation members, supported but dropped
-        }
-        else
-            return 0;
-        // support empty action set
-        bool is_empty = false;
-        bool is_simple = false;
-        if (!self->parser.action) {
-            log_debug("%s: no action configured", __func__);
-            is_empty = true;
-        }
-        else {
-            is_simple = streq(self->parser.action, "EMAIL") ||
-                        streq(self->parser.action, "SMS") ||
-                        streq(self->parser.action, "AUTOMATION");
-            if (!is_simple && (!self->parser.act_asset || !self->parser.act_mode)) {
-                log_debug("%s: action is not recognized, nor asset nor mode", __func__);
-                return 0;
-            }
-        }
-        // we are all set
-        const char *start = mylocator + strlen("results/");
-        const char *slash = strchr(start, '/');
-        if (!slash) {
-            log_error ("malformed json: %s", mylocator);
-            zstr_free (&self->parser.action);
-            zstr_free (&self->parser.act_asset);
-            zstr_free (&self->parser.act_mode);
+static int
+s_rule_json_evaluation (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    if (*path == 0) s_rule_json_set (&self->evaluation, value, len);
+    return 0;
+}
+
+static int
+s_rule_json_metrics (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    s_rule_json_append (self->metrics, value, len, false);
+    return 0;
+}
+
+static int
+s_rule_json_assets (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    //  list items only, i.e. assets/<index>
+    if (!strchr (locator, '/'))
+        return 0;
+    s_rule_json_append (self->assets, value, len, false);
+    return 0;
+}
+
+static int
+s_rule_json_groups (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    //  list items only, i.e. groups/<index>
+    if (!strchr (locator, '/'))
+        return 0;
+    s_rule_json_append (self->groups, value, len, false);
+    return 0;
+}
+
+static int
+s_rule_json_models (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    //  list items only, i.e. models/<index>
+    if (!strchr (locator, '/'))
+        return 0;
+    s_rule_json_append (self->models, value, len, true);
+    return 0;
+}
+
+static int
+s_rule_json_types (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    //  list items only, i.e. types/<index>
+    if (!strchr (locator, '/'))
+        return 0;
+    s_rule_json_append (self->types, value, len, true);
+    return 0;
+}
+
+static int
+s_rule_json_results (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    if (*path == 0)
+        return 0;
+    const char *end = strrchr (locator, '/') + 1;
+    const char *prev = end - strlen ("action/");
+    // OLD FORMAT:
+    // results/high_critical/action/0
+    if (*end >= '0' && *end <= '9' && strncmp (prev, "action", strlen("action")) == 0) {
+        s_rule_json_set (&self->parser.action, value, len);
+    }
+    // NEW FORMAT:
+    // results/high_critical/action/0/action
+    // results/high_critical/action/0/asset for action == "GPO_INTERACTION"
+    // results/high_critical/action/0/mode  ditto
+    else if (streq (end, "action")) {
+        s_rule_json_set (&self->parser.action, value, len);
+    }
+    else if (streq (end, "asset")) {
+        s_rule_json_set (&self->parser.act_asset, value, len);
+    }
+    else if (streq (end, "mode")) {
+        s_rule_json_set (&self->parser.act_mode, value, len);
+    }
+    else if (streq (end, "severity") || streq (end, "description")) {
+        // action == AUTOMATION
+        // automation members, supported but dropped
+    }
+    else
+        return 0;
+    // support empty action set
+    bool is_empty = false;
+    bool is_simple = false;
+    if (!self->parser.action) {
+        log_debug("%s: no action configured", __func__);
+        is_empty = true;
+    }
+    else {
+        is_simple = streq(self->parser.action, "EMAIL") ||
+                    streq(self->parser.action, "SMS") ||
+                    streq(self->parser.action, "AUTOMATION");
+        if (!is_simple && (!self->parser.act_asset || !self->parser.act_mode)) {
+            log_debug("%s: action is not recognized, nor asset nor mode", __func__);
             return 0;
         }
-        char *key = (char *)zmalloc(slash - start + 1);
-        memcpy(key, start, slash - start);
-        log_debug("%s: key = %s", __func__, key);
-        if (is_simple) {
-            rule_add_result_action (self, key, self->parser.action);
-        } else {
-            if (!is_empty) {
-                char *action = zsys_sprintf("%s:%s:%s",
-                        self->parser.action,
-                        self->parser.act_asset,
-                        self->parser.act_mode);
-                rule_add_result_action (self, key, action);
-                zstr_free (&action);
-            }
-            else {
-                rule_add_result_action (self, key, NULL);
-            }
-        }
-        zstr_free (&key);
+    }
+    // we are all set
+    const char *start = path;
+    const char *slash = strchr(start, '/');
+    if (!slash) {
+        log_error ("malformed json: %s", locator);
         zstr_free (&self->parser.action);
         zstr_free (&self->parser.act_asset);
         zstr_free (&self->parser.act_mode);
+        return 0;
     }
-    else if (streq (mylocator, "evaluation")) {
-        zstr_free (&self -> evaluation);
-        self -> evaluation = vsjson_decode_string (value);
-    }
-    else
-    if (strncmp (mylocator, "variables/", 10) == 0)
-    {
-        //  locator e.g. variables/low_critical
-        char *slash = (char*) strchr (mylocator, '/');
-        if (!slash)
-            return 0;
-        slash = slash + 1;
-        char *variable_value = vsjson_decode_string (value);
-        if (!variable_value || strlen (variable_value) == 0) {
-            zstr_free (&variable_value);
-            return 0;
+    char *key = (char *)zmalloc(slash - start + 1);
+    memcpy(key, start, slash - start);
+    log_debug("%s: key = %s", __func__, key);
+    if (is_simple) {
+        rule_add_result_action (self, key, self->parser.action);
+    } else {
+        if (!is_empty) {
+            char *action = zsys_sprintf("%s:%s:%s",
+                    self->parser.action,
+                    self->parser.act_asset,
+                    self->parser.act_mode);
+            rule_add_result_action (self, key, action);
+            zstr_free (&action);
+        }
+        else {
+            rule_add_result_action (self, key, NULL);
         }
-        zhashx_insert (self->variables, slash, variable_value);
-        zstr_free (&variable_value);
     }
+    zstr_free (&key);
+    zstr_free (&self->parser.action);
+    zstr_free (&self->parser.act_asset);
+    zstr_free (&self->parser.act_mode);
+    return 0;
+}
 
+static int
+s_rule_json_variables (rule_t *self, const char *locator, const char *path, const char *value, size_t len)
+{
+    //  locator e.g. variables/low_critical
+    if (*path == 0)
+        return 0;
+    char *variable_value = vsjson_decode_nstring (value, len);
+    if (variable_value && strlen (variable_value) > 0)
+        zhashx_insert (self->variables, path, variable_value);
+    zstr_free (&variable_value);
     return 0;
 }
 
+//  Field lookup on the first locator segment. The first character selects
+//  at most two candidates, which are then confirmed by length and content.
+//  For eleven fixed fields this hand-written switch does what a generated
+//  perfect hash or trie would, one branch and one memcmp, without a
+//  generator in the build. A new field needs its case in the switch too.
+
+#define S_RULE_FIELD(name) { #name, sizeof (#name) - 1, s_rule_json_##name }
+
+typedef struct {
+    const char *name;
+    size_t len;
+    rule_json_field_fn *fn;
+} rule_json_field_t;
+
+static const rule_json_field_t
+s_rule_json_fields [] = {
+    S_RULE_FIELD (assets),          // 0 a
+    S_RULE_FIELD (description),     // 1 d
+    S_RULE_FIELD (evaluation),      // 2 e
+    S_RULE_FIELD (groups),          // 3 g
+    S_RULE_FIELD (logical_asset),   // 4 l
+    S_RULE_FIELD (metrics),         // 5 m
+    S_RULE_FIELD (models),          // 6 m
+    S_RULE_FIELD (name),            // 7 n
+    S_RULE_FIELD (results),         // 8 r
+    S_RULE_FIELD (types),           // 9 t
+    S_RULE_FIELD (variables),       // 10 v
+};
+
+static rule_json_field_fn *
+s_rule_json_dispatch (const char *segment, size_t len)
+{
+    const rule_json_field_t *field = NULL;
+    switch (segment[0]) {
+    case 'a': field = &s_rule_json_fields[0]; break;
+    case 'd': field = &s_rule_json_fields[1]; break;
+    case 'e': field = &s_rule_json_fields[2]; break;
+    case 'g': field = &s_rule_json_fields[3]; break;
+    case 'l': field = &s_rule_json_fields[4]; break;
+    case 'm': field = &s_rule_json_fields[len == 7 ? 5 : 6]; break;
+    case 'n': field = &s_rule_json_fields[7]; break;
+    case 'r': field = &s_rule_json_fields[8]; break;
+    case 't': field = &s_rule_json_fields[9]; break;
+    case 'v': field = &s_rule_json_fields[10]; break;
+    default: return NULL;
+    }
+    if (field->len != len || memcmp (field->name, segment, len) != 0)
+        return NULL;
+    return field->fn;
+}
+
+static int
+rule_json_callback (const char *locator, const char *value, size_t len, void *data)
+{
+    if (!data) return 1;
+
+    rule_t *self = (rule_t *) data;
+
+    // incomming json can be encapsulated with { "flexible": ... } envelope
+    const char *mylocator = locator;
+    if (strncmp (locator, "flexible/",9) == 0) mylocator = &locator[9];
+
+    const char *slash = strchr (mylocator, '/');
+    size_t seglen = slash ? (size_t) (slash - mylocator) : strlen (mylocator);
+    rule_json_field_fn *fn = s_rule_json_dispatch (mylocator, seglen);
+    if (!fn)
+        return 0;
+    return fn (self, mylocator, slash ? slash + 1 : "", value, len);
+}
+
 //  --------------------------------------------------------------------------
 //  Parse JSON into rule.
 
 int rule_parse (rule_t *self, const char *json)
 {
-    int r = vsjson_parse (json, rule_json_callback, self, true);
+    s_rule_json_invalidate (self);
+    int r = vsjson_parse_view (json, rule_json_callback, self, true);
     if (r != 0)
         log_error("vsjson_parse failed (r: %d)\njson:\n%s\n", r, json);
     return r;
@@ -393,6 +576,86 @@ rule_type_exists (rule_t *self, const char *type)
     return zlist_exists (self->types, (void *) type);
 }
 
+//  --------------------------------------------------------------------------
+//  Return the first asset. If there are no assets, returns NULL.
+
+const char *
+rule_asset_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->assets);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next asset. If there are no (more) assets, returns NULL.
+
+const char *
+rule_asset_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->assets);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first group. If there are no groups, returns NULL.
+
+const char *
+rule_group_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->groups);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next group. If there are no (more) groups, returns NULL.
+
+const char *
+rule_group_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->groups);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first model. If there are no models, returns NULL.
+
+const char *
+rule_model_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->models);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next model. If there are no (more) models, returns NULL.
+
+const char *
+rule_model_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->models);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first type. If there are no types, returns NULL.
+
+const char *
+rule_type_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->types);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next type. If there are no (more) types, returns NULL.
+
+const char *
+rule_type_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->types);
+}
+
 //  --------------------------------------------------------------------------
 //  Get rule actions
 
@@ -478,6 +741,8 @@ void rule_merge (rule_t *old_rule, rule_t *new_rule)
     // be destroyed. The proper fix is to use zhashx and duplicate the hash.
     new_rule->result_actions = old_rule->result_actions;
     old_rule->result_actions = NULL;
+    s_rule_json_invalidate (old_rule);
+    s_rule_json_invalidate (new_rule);
 }
 
 //  --------------------------------------------------------------------------
@@ -500,80 +765,400 @@ int rule_save (rule_t *self, const char *path)
     return 0;
 }
 
+//  --------------------------------------------------------------------------
+//  Set count of shared lua VMs used by rules compiled from now on, 0 gives
+//  every rule its own VM.
+
+void
+rule_set_shared_vms (int count)
+{
+    if (count < 0) count = 0;
+    if (count > RULE_MAX_VMS) count = RULE_MAX_VMS;
+    s_vms_count = count;
+}
+
+//  Returns memory (in bytes) used by lua VM of the rule, 0 if not compiled
+size_t
+rule_lua_memory (rule_t *self)
+{
+    if (!self || !self->lua) return 0;
+    return (size_t) lua_gc (self->lua, LUA_GCCOUNT, 0) * 1024 + lua_gc (self->lua, LUA_GCCOUNTB, 0);
+}
+
+//  --------------------------------------------------------------------------
+//  Set directory where compiled evaluation chunks are cached, NULL or ""
+//  disables the cache.
+
+void
+rule_set_bytecode_cache (const char *dir)
+{
+    zstr_free (&s_bytecode_dir);
+    if (dir && !streq (dir, "")) {
+        zsys_dir_create ("%s", dir);
+        s_bytecode_dir = strdup (dir);
+    }
+}
+
+//  Cache file of rule. Rule names come from the mailbox, the file is named
+//  after sha1 of the name so that it can't leave the cache directory.
+static char *
+s_bytecode_path (const char *name)
+{
+    zdigest_t *digest = zdigest_new ();
+    zdigest_update (digest, (const byte *) name, strlen (name));
+    char *path = zsys_sprintf ("%s/%s.luac", s_bytecode_dir, zdigest_string (digest));
+    zdigest_destroy (&digest);
+    return path;
+}
+
+//  --------------------------------------------------------------------------
+//  Remove cached evaluation chunk of the rule name, if any
+
+void
+rule_bytecode_remove (const char *name)
+{
+    if (!s_bytecode_dir || !name)
+        return;
+    char *path = s_bytecode_path (name);
+    if (unlink (path) != 0 && errno != ENOENT)
+        log_warning ("can't remove bytecode of rule '%s' (%s)", name, strerror (errno));
+    zstr_free (&path);
+}
+
+static int
+s_bytecode_writer (lua_State *lua, const void *p, size_t size, void *fd)
+{
+    (void) lua;
+    return write (*(int *) fd, p, size) == (ssize_t) size ? 0 : 1;
+}
+
+//  Load evaluation chunk of the rule on top of the lua stack. Cache file
+//  holds sha1 of the evaluation text on first line, then lua bytecode, and
+//  is rewritten whenever it does not match.
+static int
+s_load_chunk (rule_t *self)
+{
+    if (!s_bytecode_dir)
+        return luaL_loadstring (self->lua, self->evaluation);
+
+    zdigest_t *digest = zdigest_new ();
+    zdigest_update (digest, (const byte *) self->evaluation, strlen (self->evaluation));
+    char *hash = strdup (zdigest_string (digest));
+    zdigest_destroy (&digest);
+    size_t hashlen = strlen (hash);
+    char *path = s_bytecode_path (self->name);
+
+    int r = -1;
+    int fd = open (path, O_RDONLY);
+    if (fd != -1) {
+        struct stat rstat;
+        if (fstat (fd, &rstat) == 0 && (size_t) rstat.st_size > hashlen + 1) {
+            char *buffer = (char *) zmalloc (rstat.st_size);
+            if (read (fd, buffer, rstat.st_size) == rstat.st_size &&
+                memcmp (buffer, hash, hashlen) == 0 && buffer[hashlen] == '\n') {
+                r = luaL_loadbuffer (self->lua, buffer + hashlen + 1, rstat.st_size - hashlen - 1, self->name);
+                if (r != 0) {
+                    log_warning ("bytecode of rule '%s' can't be loaded", self->name);
+                    lua_pop (self->lua, 1);
+                }
+            }
+            free (buffer);
+        }
+        close (fd);
+    }
+    if (r == 0) {
+        log_trace ("rule '%s' loaded from bytecode cache", self->name);
+    }
+    else {
+        r = luaL_loadstring (self->lua, self->evaluation);
+        if (r == 0) {
+            char *tmp = zsys_sprintf ("%s.tmp", path);
+            fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd != -1) {
+                bool ok = write (fd, hash, hashlen) == (ssize_t) hashlen && write (fd, "\n", 1) == 1;
+#if LUA_VERSION_NUM > 502
+                ok = ok && lua_dump (self->lua, s_bytecode_writer, &fd, 0) == 0;
+#else
+                ok = ok && lua_dump (self->lua, s_bytecode_writer, &fd) == 0;
+#endif
+                close (fd);
+                if (!ok || rename (tmp, path) != 0) {
+                    log_warning ("can't write bytecode of rule '%s' to %s", self->name, path);
+                    unlink (tmp);
+                }
+            }
+            zstr_free (&tmp);
+        }
+    }
+    zstr_free (&path);
+    zstr_free (&hash);
+    return r;
+}
+
+//  Push environment of the rule: its own table in shared VM, else globals
+static void
+s_push_env (rule_t *self)
+{
+    if (self->lua_env != LUA_NOREF)
+        lua_rawgeti (self->lua, LUA_REGISTRYINDEX, self->lua_env);
+    else
+#if LUA_VERSION_NUM > 501
+        lua_pushglobaltable (self->lua);
+#else
+        lua_pushvalue (self->lua, LUA_GLOBALSINDEX);
+#endif
+}
+
+static void *
+s_lua_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    rule_lua_heap_t *heap = (rule_lua_heap_t *) ud;
+    // lua 5.2+ passes object type in osize of new blocks
+    size_t old = ptr ? osize : 0;
+    if (nsize == 0) {
+        free (ptr);
+        heap->used -= old;
+        return NULL;
+    }
+    if (heap->enforced && heap->limit && nsize > old && heap->used - old + nsize > heap->limit) {
+        heap->exceeded |= RULE_BUDGET_MEMORY;
+        return NULL;
+    }
+    void *block = realloc (ptr, nsize);
+    if (block)
+        heap->used = heap->used - old + nsize;
+    return block;
+}
+
+static rule_lua_heap_t *
+s_lua_heap (lua_State *lua)
+{
+    void *heap = NULL;
+    lua_getallocf (lua, &heap);
+    return (rule_lua_heap_t *) heap;
+}
+
+//  Instruction count hook, stops the running call
+static void
+s_lua_hook (lua_State *lua, lua_Debug *ar)
+{
+    (void) ar;
+    s_lua_heap (lua)->exceeded |= RULE_BUDGET_INSTRUCTIONS;
+    // fire on every instruction from now on, so that the error can't be
+    // caught by pcall in the rule and ignored
+    lua_sethook (lua, s_lua_hook, LUA_MASKCOUNT, 1);
+    luaL_error (lua, "instruction budget exceeded");
+}
+
+static int
+s_lua_panic (lua_State *lua)
+{
+    log_fatal ("unprotected error in lua: %s", lua_tostring (lua, -1));
+    return 0;
+}
+
+static lua_State *
+s_lua_new (void)
+{
+    rule_lua_heap_t *heap = (rule_lua_heap_t *) zmalloc (sizeof (rule_lua_heap_t));
+    lua_State *lua = lua_newstate (s_lua_alloc, heap);
+    if (!lua) {
+        free (heap);
+        return NULL;
+    }
+    lua_atpanic (lua, s_lua_panic);
+    luaL_openlibs(lua); // get functions like print();
+    return lua;
+}
+
+static void
+s_lua_close (lua_State *lua)
+{
+    rule_lua_heap_t *heap = s_lua_heap (lua);
+    lua_close (lua);
+    free (heap);
+}
+
+//  Release lua context of the rule
+static void
+s_lua_release (rule_t *self)
+{
+    if (self->lua_vm >= 0) {
+        luaL_unref (self->lua, LUA_REGISTRYINDEX, self->lua_env);
+        // stack may hold message borrowed from another rule, leave it
+        if (--s_vms[self->lua_vm].rules == 0) {
+            s_lua_close (s_vms[self->lua_vm].lua);
+            s_vms[self->lua_vm].lua = NULL;
+        }
+    }
+    else if (self->lua)
+        s_lua_close (self->lua);
+    self->lua = NULL;
+    self->lua_vm = -1;
+    self->lua_env = LUA_NOREF;
+    zstr_free (&self->lua_name);
+    zstr_free (&self->lua_iname);
+}
+
+//  Attach rule to the least used shared VM and create its environment
+static int
+s_lua_attach_shared (rule_t *self)
+{
+    int vm = 0;
+    for (int i = 1; i < s_vms_count; i++) {
+        if (s_vms[i].rules < s_vms[vm].rules)
+            vm = i;
+    }
+    if (!s_vms[vm].lua) {
+        s_vms[vm].lua = s_lua_new ();
+        if (!s_vms[vm].lua) return 0;
+    }
+    s_vms[vm].rules++;
+    self->lua = s_vms[vm].lua;
+    self->lua_vm = vm;
+
+    // environment table, globals of the VM are visible through __index
+    lua_newtable (self->lua);
+    lua_newtable (self->lua);
+#if LUA_VERSION_NUM > 501
+    lua_pushglobaltable (self->lua);
+#else
+    lua_pushvalue (self->lua, LUA_GLOBALSINDEX);
+#endif
+    lua_setfield (self->lua, -2, "__index");
+    lua_setmetatable (self->lua, -2);
+    self->lua_env = luaL_ref (self->lua, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+//  Rule went over its lua budget. The call was stopped, rules doing so
+//  repeatedly are quarantined: not evaluated anymore and their lua context
+//  released. Replacing the rule lifts the quarantine.
+static void
+s_rule_over_budget (rule_t *self, int exceeded)
+{
+    self->budget_exceeded++;
+    log_error ("rule '%s' exceeded its lua %s budget (%llu times)", self->name,
+        exceeded & RULE_BUDGET_INSTRUCTIONS ? "instructions" : "memory",
+        (unsigned long long) self->budget_exceeded);
+    if (self->budget_exceeded >= RULE_BUDGET_STRIKES && !self->quarantined) {
+        log_error ("rule '%s' quarantined", self->name);
+        self->quarantined = true;
+    }
+}
+
+//  lua_pcall within the budget of a rule call
+static int
+s_lua_pcall (rule_t *self, int nargs, int nresults)
+{
+    rule_lua_heap_t *heap = s_lua_heap (self->lua);
+    heap->limit = s_lua_memory * (self->lua_vm >= 0 ? s_vms[self->lua_vm].rules : 1);
+    heap->exceeded = 0;
+    heap->enforced = true;
+    if (s_lua_instructions > 0)
+        lua_sethook (self->lua, s_lua_hook, LUA_MASKCOUNT, s_lua_instructions);
+    int r = lua_pcall (self->lua, nargs, nresults, 0);
+    lua_sethook (self->lua, NULL, 0, 0);
+    heap->enforced = false;
+    // error may have been caught by the rule itself, it still counts
+    if (heap->exceeded)
+        s_rule_over_budget (self, heap->exceeded);
+    return r;
+}
+
 // ZZZ return 1 if ok, else 0
 static int rule_compile (rule_t *self)
 {
     if (!self) return 0;
     // destroy old context
-    if (self -> lua) {
-        lua_close (self->lua);
-        self->lua = NULL;
-    }
+    s_lua_release (self);
     // compile
+    if (s_vms_count > 0) {
+        if (!s_lua_attach_shared (self)) return 0;
+    }
+    else {
+        self -> lua = s_lua_new ();
+        if (!self->lua) return 0;
+    }
+    int r = s_load_chunk (self);
+    if (r == 0 && self->lua_env != LUA_NOREF) {
+        s_push_env (self);
 #if LUA_VERSION_NUM > 501
-    self -> lua = luaL_newstate();
+        lua_setupvalue (self->lua, -2, 1);
 #else
-    self -> lua = lua_open();
+        lua_setfenv (self->lua, -2);
 #endif
-    if (!self->lua) return 0;
-    luaL_openlibs(self -> lua); // get functions like print();
-    if (luaL_dostring (self -> lua, self -> evaluation) != 0) {
+    }
+    if (r != 0 || s_lua_pcall (self, 0, LUA_MULTRET) != 0) {
         log_error ("rule '%s' has an error", self -> name);
         log_debug ("ERROR, rule '%s' evaluation part\n%s", self -> name, self -> evaluation);
-        lua_close (self -> lua);
-        self -> lua = NULL;
+        s_lua_release (self);
         return 0;
     }
-    lua_getglobal (self -> lua, "main");
+    lua_settop (self->lua, 0);
+    s_push_env (self);
+    lua_getfield (self -> lua, 1, "main");
     if (!lua_isfunction (self -> lua, -1)) {
         log_error ("main function not found in rule %s", self -> name);
-        lua_close (self->lua);
-        self -> lua = NULL;
+        s_lua_release (self);
         return 0;
     }
+    lua_pop (self->lua, 1);
     lua_pushnumber(self -> lua, 0);
-    lua_setglobal(self -> lua, "OK");
+    lua_setfield(self -> lua, 1, "OK");
     lua_pushnumber(self -> lua, 1);
-    lua_setglobal(self -> lua, "WARNING");
+    lua_setfield(self -> lua, 1, "WARNING");
     lua_pushnumber(self -> lua, 1);
-    lua_setglobal(self -> lua, "HIGH_WARNING");
+    lua_setfield(self -> lua, 1, "HIGH_WARNING");
     lua_pushnumber(self -> lua, 2);
-    lua_setglobal(self -> lua, "CRITICAL");
+    lua_setfield(self -> lua, 1, "CRITICAL");
     lua_pushnumber(self -> lua, 2);
-    lua_setglobal(self -> lua, "HIGH_CRITICAL");
+    lua_setfield(self -> lua, 1, "HIGH_CRITICAL");
     lua_pushnumber(self -> lua, -1);
-    lua_setglobal(self -> lua, "LOW_WARNING");
+    lua_setfield(self -> lua, 1, "LOW_WARNING");
     lua_pushnumber(self -> lua, -2);
-    lua_setglobal(self -> lua, "LOW_CRITICAL");
+    lua_setfield(self -> lua, 1, "LOW_CRITICAL");
 
     //  set global variables
     const char *item = (const char *) zhashx_first (self->variables);
     while (item) {
         const char *key = (const char *) zhashx_cursor (self->variables);
         lua_pushstring (self->lua, item);
-        lua_setglobal (self->lua, key);
+        lua_setfield (self->lua, 1, key);
         item = (const char *) zhashx_next (self->variables);
     }
+    lua_settop (self->lua, 0);
 
+    if (self->lua_vm >= 0)
+        log_debug ("rule '%s' compiled into shared lua VM #%d (rules: %d, memory: %zu bytes)",
+            self->name, self->lua_vm, s_vms[self->lua_vm].rules, rule_lua_memory (self));
     return 1;
 }
 
 //  --------------------------------------------------------------------------
-//  Evaluate rule
+//  Evaluate rule. Params are pushed as they are, NAME and INAME globals are
+//  only set again when the asset differs from the previous evaluation.
+//  Message is owned by the lua context and valid until the next evaluation
+//  of a rule.
 
 void
-rule_evaluate (rule_t *self, zlist_t *params, const char *iname, const char *ename, int *result, char **message)
+rule_evaluate (rule_t *self, const char **params, int count, const char *iname, const char *ename, int *result, const char **message)
 {
     if (result) *result = RULE_ERROR;
     if (message) *message = NULL;
 
-    if (!self || !params || !iname || !result || !message) {
+    if (!self || (count && !params) || !iname || !result || !message) {
         log_error("bad args");
         return;
     }
 
     log_trace("rule_evaluate %s", rule_name(self));
 
+    if (self->quarantined) {
+        log_trace("rule %s is quarantined", rule_name(self));
+        return;
+    }
+
     if (!self -> lua) {
         if (! rule_compile (self)) {
             log_error("rule_compile %s failed", rule_name(self));
@@ -581,280 +1166,441 @@ rule_evaluate (rule_t *self, zlist_t *params, const char *iname, const char *ena
         }
     }
 
-    lua_pushstring(self -> lua, ename ? ename : iname);
-    lua_setglobal(self -> lua, "NAME");
-    lua_pushstring(self -> lua, iname);
-    lua_setglobal(self -> lua, "INAME");
+    // drop results of previous evaluation, environment goes to index 1
     lua_settop (self->lua, 0);
-    lua_getglobal (self->lua, "main");
+    s_push_env (self);
+
+    const char *name = ename ? ename : iname;
+    if (!self->lua_name || !streq (self->lua_name, name)) {
+        lua_pushstring(self -> lua, name);
+        lua_setfield(self -> lua, 1, "NAME");
+        zstr_free (&self->lua_name);
+        self->lua_name = strdup (name);
+    }
+    if (!self->lua_iname || !streq (self->lua_iname, iname)) {
+        lua_pushstring(self -> lua, iname);
+        lua_setfield(self -> lua, 1, "INAME");
+        zstr_free (&self->lua_iname);
+        self->lua_iname = strdup (iname);
+    }
+    lua_getfield (self->lua, 1, "main");
 
-    char *value = (char *) zlist_first (params);
-    int i = 0;
-    while (value) {
-        log_trace("rule_evaluate: push param #%d: %s", i, value);
-        lua_pushstring (self -> lua, value);
-        value = (char *) zlist_next (params);
-        i++;
+    for (int i = 0; i < count; i++) {
+        log_trace("rule_evaluate: push param #%d: %s", i, params[i]);
+        lua_pushstring (self -> lua, params[i]);
     }
 
-    int r = lua_pcall(self -> lua, zlist_size (params), 2, 0);
+    int64_t start = zclock_usecs ();
+    int r = s_lua_pcall (self, count, 2);
+    uint64_t usecs = (uint64_t) (zclock_usecs () - start);
+    self->evaluations++;
+    self->lua_usecs += usecs;
+    self->lua_histogram [s_histogram_bucket (usecs)]++;
 
     if (r == 0) {
         // calculated
         if (lua_isnumber (self -> lua, -1)) {
             *result = lua_tointeger(self -> lua, -1);
-            const char *msg = lua_tostring (self->lua, -2);
-            if (msg) *message = strdup (msg);
+            *message = lua_tostring (self->lua, -2);
         }
         else if (lua_isnumber (self -> lua, -2)) {
             *result = lua_tointeger(self -> lua, -2);
-            const char *msg = lua_tostring (self->lua, -1);
-            if (msg) *message = strdup (msg);
+            *message = lua_tostring (self->lua, -1);
         }
         else {
             log_error("rule_evaluate: invalid content of self->lua.");
+            self->errors++;
         }
-
-        lua_pop (self->lua, 2);
+        // results stay on the stack, message points there
     }
     else {
         log_error("rule_evaluate: lua_pcall %s failed (r: %d)", rule_name(self), r);
+        lua_settop (self->lua, 0);
+        self->errors++;
+    }
+    // lua context of quarantined rule is released by rule_lua_release, not
+    // here: shared VM bookkeeping is not safe from worker threads
+    if (self->quarantined) {
+        *result = RULE_ERROR;
+        *message = NULL;
     }
 }
 
 //  --------------------------------------------------------------------------
-//  Create json from rule
+//  Evaluation statistics of the rule
 
-static char * s_string_append (char **string_p, size_t *capacity, const char *append)
+void
+rule_eval_stats (rule_t *self, uint64_t *evaluations, uint64_t *errors, uint64_t *lua_usecs)
 {
-    if (! string_p) return NULL;
-    if (! capacity) return NULL;
-    if (! append) return *string_p;
+    assert (self);
+    if (evaluations) *evaluations = self->evaluations;
+    if (errors) *errors = self->errors;
+    if (lua_usecs) *lua_usecs = self->lua_usecs;
+}
 
-    char *string = *string_p;
-    if (!string) {
-        string = (char *) zmalloc (512);
-        *capacity = 512;
+uint64_t
+rule_lua_percentile (rule_t *self, int percent)
+{
+    if (!self || self->evaluations == 0) return 0;
+    uint64_t rank = (self->evaluations * percent + 99) / 100;
+    uint64_t count = 0;
+    for (int i = 0; i < RULE_HISTOGRAM_BUCKETS; i++) {
+        count += self->lua_histogram [i];
+        if (count >= rank && count > 0)
+            return s_histogram_upper (i);
     }
+    return s_histogram_upper (RULE_HISTOGRAM_BUCKETS - 1);
+}
 
-    size_t l1 = strlen (string);
-    size_t l2 = strlen (append);
-    size_t required = l1+l2+1;
-    if (*capacity < required) {
-        size_t newcapacity = *capacity;
-        while (newcapacity < required) {
-            newcapacity += 512;
-        }
-        char *tmp = (char *) realloc (string, newcapacity);
-        if (!tmp) {
-            free (string);
-            *capacity = 0;
-            return NULL;
-        }
-        string = tmp;
-        *capacity = newcapacity;
-    }
-    strncat (string, append, *capacity);
-    *string_p = string;
-    return string;
+//  --------------------------------------------------------------------------
+//  Set lua budget of rule calls, 0 disables the limit. Memory is the heap
+//  cap of a VM per rule it holds, at least RULE_LUA_MEMORY_MIN.
+
+void
+rule_set_lua_budget (int instructions, size_t memory)
+{
+    s_lua_instructions = std::max (instructions, 0);
+    s_lua_memory = memory ? std::max<size_t> (memory, RULE_LUA_MEMORY_MIN) : 0;
 }
 
-static char * s_zlist_to_json_array (zlist_t* list)
+uint64_t
+rule_budget_exceeded (rule_t *self)
 {
-    if (!list) return strdup("[]");
-    char *item = (char *) zlist_first (list);
-    char *json = NULL;
-    size_t jsonsize = 0;
-    s_string_append (&json, &jsonsize, "[");
-    while (item) {
-        char *encoded = vsjson_encode_string (item);
-        s_string_append (&json, &jsonsize, encoded);
-        s_string_append (&json, &jsonsize, ", ");
-        zstr_free (&encoded);
-        item = (char *) zlist_next (list);
+    assert (self);
+    return self->budget_exceeded;
+}
+
+bool
+rule_quarantined (rule_t *self)
+{
+    assert (self);
+    return self->quarantined;
+}
+
+//  --------------------------------------------------------------------------
+//  Release lua context of the rule, it is compiled again when needed.
+//  Messages returned by rule_evaluate are not valid anymore.
+
+void
+rule_lua_release (rule_t *self)
+{
+    assert (self);
+    s_lua_release (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Compile rule when needed and return its lua state as an opaque key.
+//  Rules returning the same key share the state and must not be evaluated
+//  concurrently. Returns NULL if the rule does not compile.
+
+const void *
+rule_lua_key (rule_t *self)
+{
+    if (!self || self->quarantined) return NULL;
+    if (!self->lua && !rule_compile (self)) return NULL;
+    return self->lua;
+}
+
+//  --------------------------------------------------------------------------
+//  Create json from rule. Everything is encoded straight into one buffer,
+//  sized up front from the rule content so that it is normally allocated
+//  once.
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool compact;               // no newlines
+    bool failed;                // allocation failed, data is gone
+} rule_json_writer_t;
+
+static bool
+s_json_reserve (rule_json_writer_t *writer, size_t len)
+{
+    if (writer->failed)
+        return false;
+    size_t required = writer->size + len + 1;
+    if (writer->data && required <= writer->capacity)
+        return true;
+    size_t capacity = writer->capacity > 512 ? writer->capacity : 512;
+    while (capacity < required)
+        capacity *= 2;
+    char *data = (char *) realloc (writer->data, capacity);
+    if (!data) {
+        zstr_free (&writer->data);
+        writer->failed = true;
+        return false;
     }
-    if (zlist_size (list)) {
-        size_t x = strlen (json);
-        json [x-2] = 0;
+    writer->data = data;
+    writer->capacity = capacity;
+    return true;
+}
+
+static void
+s_json_raw (rule_json_writer_t *writer, const char *string, size_t len)
+{
+    if (!s_json_reserve (writer, len)) return;
+    memcpy (writer->data + writer->size, string, len);
+    writer->size += len;
+}
+
+static void
+s_json_put (rule_json_writer_t *writer, const char *string)
+{
+    s_json_raw (writer, string, strlen (string));
+}
+
+static void
+s_json_nl (rule_json_writer_t *writer)
+{
+    if (!writer->compact) s_json_raw (writer, "\n", 1);
+}
+
+//  Encoded json string, nothing is written for NULL
+static void
+s_json_nstring (rule_json_writer_t *writer, const char *string, size_t len)
+{
+    if (!string || !s_json_reserve (writer, 2 * len + 2)) return;
+    writer->size += vsjson_encode_nstring_to (string, len, writer->data + writer->size);
+}
+
+static void
+s_json_string (rule_json_writer_t *writer, const char *string)
+{
+    if (string) s_json_nstring (writer, string, strlen (string));
+}
+
+static void
+s_json_string_array (rule_json_writer_t *writer, zlist_t *list)
+{
+    s_json_raw (writer, "[", 1);
+    if (list) {
+        const char *item = (const char *) zlist_first (list);
+        bool first = true;
+        while (item) {
+            if (!first) s_json_raw (writer, ", ", 2);
+            first = false;
+            s_json_string (writer, item);
+            item = (const char *) zlist_next (list);
+        }
     }
-    s_string_append (&json, &jsonsize, "]");
-    return json;
+    s_json_raw (writer, "]", 1);
 }
 
-static char * s_actions_to_json_array (zlist_t *actions)
+static void
+s_json_actions_array (rule_json_writer_t *writer, zlist_t *actions)
 {
-    char *item = (char *) zlist_first (actions);
-    char *json = NULL;
-    size_t jsonsize = 0;
-    s_string_append (&json, &jsonsize, "[");
+    s_json_raw (writer, "[", 1);
+    const char *item = (const char *) zlist_first (actions);
+    bool first = true;
     while (item) {
-        s_string_append (&json, &jsonsize, "{\"action\": ");
+        if (!first) s_json_raw (writer, ", ", 2);
+        first = false;
+        s_json_put (writer, "{\"action\": ");
         const char *p = item;
         const char *colon = strchr (p, ':');
         if (!colon) {
             // recognized action?
             if (!streq(item, "EMAIL") && !streq(item, "SMS") && !streq(item, "AUTOMATION"))
                 log_warning ("Unrecognized action: %s", item);
-            char *encoded = vsjson_encode_string(item);
-            s_string_append (&json, &jsonsize, encoded);
-            zstr_free (&encoded);
+            s_json_string (writer, item);
         } else {
             // GPO_INTERACTION
-            char *encoded = NULL;
             if (strncmp (item, "GPO_INTERACTION", colon - p) != 0)
-                log_warning ("Unrecognized action: %.*s", colon - p, p);
-            encoded = vsjson_encode_nstring(p, colon - p);
-            s_string_append (&json, &jsonsize, encoded);
-            zstr_free (&encoded);
-            s_string_append (&json, &jsonsize, ", \"asset\": ");
+                log_warning ("Unrecognized action: %.*s", (int) (colon - p), p);
+            s_json_nstring (writer, p, colon - p);
+            s_json_put (writer, ", \"asset\": ");
             p = colon + 1;
             if (!(colon = strchr (p, ':'))) {
                 log_warning ("Missing mode field in \"%s\"", item);
                 colon = p + strlen(p);
             }
-            encoded = vsjson_encode_nstring(p, colon - p);
-            s_string_append (&json, &jsonsize, encoded);
-            zstr_free (&encoded);
+            s_json_nstring (writer, p, colon - p);
             if (*colon == ':') {
-                s_string_append (&json, &jsonsize, ", \"mode\": ");
-                p = colon + 1;
-                encoded = vsjson_encode_string(p);
-                s_string_append (&json, &jsonsize, encoded);
-                zstr_free (&encoded);
+                s_json_put (writer, ", \"mode\": ");
+                s_json_string (writer, colon + 1);
             }
         }
-        s_string_append (&json, &jsonsize, "}, ");
-        item = (char *) zlist_next (actions);
+        s_json_raw (writer, "}", 1);
+        item = (const char *) zlist_next (actions);
+    }
+    s_json_raw (writer, "]", 1);
+}
+
+//  Upper bound of the encoded list size
+static size_t
+s_json_list_size (zlist_t *list)
+{
+    size_t size = 2;
+    if (!list) return size;
+    for (const char *item = (const char *) zlist_first (list); item; item = (const char *) zlist_next (list))
+        size += 2 * strlen (item) + 4;
+    return size;
+}
+
+//  Upper bound of the json size for rule, used to reserve the buffer
+static size_t
+s_rule_json_size (rule_t *self)
+{
+    size_t size = 256;
+    size += self->name ? 2 * strlen (self->name) : 0;
+    size += self->description ? 2 * strlen (self->description) : 0;
+    size += self->logical_asset ? 2 * strlen (self->logical_asset) : 0;
+    size += self->evaluation ? 2 * strlen (self->evaluation) : 0;
+    size += s_json_list_size (self->metrics);
+    size += s_json_list_size (self->assets);
+    size += s_json_list_size (self->models);
+    size += s_json_list_size (self->groups);
+    for (zlist_t *actions = (zlist_t *) zhash_first (self->result_actions); actions; actions = (zlist_t *) zhash_next (self->result_actions)) {
+        size += 2 * strlen (zhash_cursor (self->result_actions)) + 24;
+        size += s_json_list_size (actions) + 40 * zlist_size (actions);
     }
-    if (zlist_size (actions)) {
-        size_t x = strlen (json);
-        json [x-2] = 0;
+    for (const char *item = (const char *) zhashx_first (self->variables); item; item = (const char *) zhashx_next (self->variables)) {
+        size += 2 * (strlen ((const char *) zhashx_cursor (self->variables)) + strlen (item)) + 8;
     }
-    s_string_append (&json, &jsonsize, "]");
-    return json;
+    return size;
 }
 
 //  --------------------------------------------------------------------------
-//  Convert rule back to json
+//  Convert rule to json, compact json has no newlines, envelope wraps it
+//  in { "flexible": ... } as expected by UI
 //  Caller is responsible for destroying the return value
 
 char *
-rule_json (rule_t *self)
+rule_json_format (rule_t *self, bool compact, bool envelope)
 {
     if (!self) return NULL;
 
-    char *json = NULL;
-    size_t jsonsize = 0;
-    {
-        //json start + name
-        char *jname = vsjson_encode_string (self->name);
-        s_string_append (&json, &jsonsize, "{\n\"name\":");
-        s_string_append (&json, &jsonsize, jname);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&jname);
-    }
-    {
-        char *desc = vsjson_encode_string (self->description ? self->description : "");
-        s_string_append (&json, &jsonsize, "\"description\":");
-        s_string_append (&json, &jsonsize, desc);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&desc);
-    }
-    {
-        char *logical_asset = vsjson_encode_string (self->logical_asset ? self->logical_asset : "");
-        s_string_append (&json, &jsonsize, "\"logical_asset\":");
-        s_string_append (&json, &jsonsize, logical_asset);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&logical_asset);
-    }
-    {
-        //metrics
-        char *tmp = s_zlist_to_json_array (self->metrics);
-        s_string_append (&json, &jsonsize, "\"metrics\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //assets
-        char *tmp = s_zlist_to_json_array (self->assets);
-        s_string_append (&json, &jsonsize, "\"assets\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //models
-        char *tmp = s_zlist_to_json_array (self->models);
-        s_string_append (&json, &jsonsize, "\"models\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //groups
-        char *tmp = s_zlist_to_json_array (self->groups);
-        s_string_append (&json, &jsonsize, "\"groups\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //results
-        s_string_append (&json, &jsonsize, "\"results\": {\n");
-        const void *result = zhash_first (self->result_actions);
-        bool first = true;
-        while (result) {
-            if (first) {
-                first = false;
-            } else {
-                s_string_append (&json, &jsonsize, ",\n");
-            }
-            char *key = vsjson_encode_string (zhash_cursor (self->result_actions));
-            char *tmp = s_actions_to_json_array ((zlist_t *)result);
-            s_string_append (&json, &jsonsize, key);
-            s_string_append (&json, &jsonsize, ": {\"action\": ");
-            s_string_append (&json, &jsonsize, tmp);
-            s_string_append (&json, &jsonsize, "}");
-            zstr_free (&tmp);
-            zstr_free (&key);
-            result = zhash_next (self->result_actions);
+    rule_json_writer_t writer = { NULL, 0, 0, compact, false };
+    if (!s_json_reserve (&writer, s_rule_json_size (self)))
+        return NULL;
+
+    if (envelope)
+        s_json_put (&writer, RULE_JSON_ENVELOPE_HEAD);
+    //json start + name
+    s_json_raw (&writer, "{", 1);
+    s_json_nl (&writer);
+    s_json_put (&writer, "\"name\":");
+    s_json_string (&writer, self->name);
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"description\":");
+    s_json_string (&writer, self->description ? self->description : "");
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"logical_asset\":");
+    s_json_string (&writer, self->logical_asset ? self->logical_asset : "");
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"metrics\":");
+    s_json_string_array (&writer, self->metrics);
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"assets\":");
+    s_json_string_array (&writer, self->assets);
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"models\":");
+    s_json_string_array (&writer, self->models);
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    s_json_put (&writer, "\"groups\":");
+    s_json_string_array (&writer, self->groups);
+    s_json_raw (&writer, ",", 1);
+    s_json_nl (&writer);
+
+    //results
+    s_json_put (&writer, "\"results\": {");
+    s_json_nl (&writer);
+    zlist_t *actions = (zlist_t *) zhash_first (self->result_actions);
+    bool first = true;
+    while (actions) {
+        if (!first) {
+            s_json_raw (&writer, ",", 1);
+            s_json_nl (&writer);
         }
-        s_string_append (&json, &jsonsize, "},\n");
+        first = false;
+        s_json_string (&writer, zhash_cursor (self->result_actions));
+        s_json_put (&writer, ": {\"action\": ");
+        s_json_actions_array (&writer, actions);
+        s_json_raw (&writer, "}", 1);
+        actions = (zlist_t *) zhash_next (self->result_actions);
     }
-    {
-        //variables
-        if (zhashx_size (self->variables)) {
-            s_string_append (&json, &jsonsize, "\"variables\": {\n");
-            char *item = (char *)zhashx_first (self->variables);
-            bool first = true;
-            while (item) {
-                if (first) {
-                    first = false;
-                } else {
-                    s_string_append (&json, &jsonsize, ",\n");
-                }
-                char *key = vsjson_encode_string((char *)zhashx_cursor (self->variables));
-                char *value = vsjson_encode_string (item);
-                s_string_append (&json, &jsonsize, key);
-                s_string_append (&json, &jsonsize, ":");
-                s_string_append (&json, &jsonsize, value);
-                zstr_free (&key);
-                zstr_free (&value);
-                item = (char *) zhashx_next (self->variables);
+    s_json_put (&writer, "},");
+    s_json_nl (&writer);
+
+    //variables
+    if (zhashx_size (self->variables)) {
+        s_json_put (&writer, "\"variables\": {");
+        s_json_nl (&writer);
+        const char *item = (const char *) zhashx_first (self->variables);
+        first = true;
+        while (item) {
+            if (!first) {
+                s_json_raw (&writer, ",", 1);
+                s_json_nl (&writer);
             }
-            s_string_append (&json, &jsonsize, "},\n");
+            first = false;
+            s_json_string (&writer, (const char *) zhashx_cursor (self->variables));
+            s_json_raw (&writer, ":", 1);
+            s_json_string (&writer, item);
+            item = (const char *) zhashx_next (self->variables);
         }
+        s_json_put (&writer, "},");
+        s_json_nl (&writer);
     }
-    {
-        //json evaluation
-        char *eval = vsjson_encode_string (self->evaluation);
-        s_string_append (&json, &jsonsize, "\"evaluation\":");
-        s_string_append (&json, &jsonsize, eval);
-        s_string_append (&json, &jsonsize, "\n}\n");
-        zstr_free (&eval);
+
+    //json evaluation
+    s_json_put (&writer, "\"evaluation\":");
+    s_json_string (&writer, self->evaluation);
+    s_json_nl (&writer);
+    s_json_raw (&writer, "}", 1);
+    s_json_nl (&writer);
+    if (envelope)
+        s_json_put (&writer, RULE_JSON_ENVELOPE_TAIL);
+
+    if (writer.data)
+        writer.data [writer.size] = 0;
+    return writer.data;
+}
+
+//  --------------------------------------------------------------------------
+//  Convert rule back to json
+//  Caller is responsible for destroying the return value
+
+char *
+rule_json (rule_t *self)
+{
+    return rule_json_format (self, false, false);
+}
+
+//  --------------------------------------------------------------------------
+//  Compact json of rule, serialized once and kept until the rule changes.
+//  Returned buffer is owned by rule and is not NUL terminated without
+//  envelope, size is set to its length.
+
+const char *
+rule_json_cached (rule_t *self, bool envelope, size_t *size)
+{
+    assert (self && size);
+    if (!self->json_cache) {
+        self->json_cache = rule_json_format (self, true, true);
+        if (!self->json_cache) return NULL;
+        self->json_cache_size = strlen (self->json_cache);
     }
-    return json;
+    if (envelope) {
+        *size = self->json_cache_size;
+        return self->json_cache;
+    }
+    const size_t head = strlen (RULE_JSON_ENVELOPE_HEAD);
+    *size = self->json_cache_size - head - strlen (RULE_JSON_ENVELOPE_TAIL);
+    return self->json_cache + head;
 }
 
 //  --------------------------------------------------------------------------
@@ -874,7 +1620,8 @@ rule_destroy (rule_t **self_p)
         zstr_free (&self->parser.action);
         zstr_free (&self->parser.act_asset);
         zstr_free (&self->parser.act_mode);
-        if (self->lua) lua_close (self->lua);
+        zstr_free (&self->json_cache);
+        s_lua_release (self);
         zlist_destroy (&self->metrics);
         zlist_destroy (&self->assets);
         zlist_destroy (&self->groups);
@@ -891,10 +1638,107 @@ rule_destroy (rule_t **self_p)
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+static int
+s_vsjson_test_callback (const char *locator, const char *value, void *data)
+{
+    zlist_append ((zlist_t *) data, zsys_sprintf ("%s=%s", locator, value ? value : "(null)"));
+    return 0;
+}
+
+static int
+s_vsjson_test_view_callback (const char *locator, const char *value, size_t len, void *data)
+{
+    zlist_append ((zlist_t *) data, zsys_sprintf ("%s=%.*s", locator, (int) len, value ? value : "(null)"));
+    return 0;
+}
+
 void
 vsjson_test (bool verbose)
 {
-    printf (" * vsjson: skip\n");
+    printf (" * vsjson: \n");
+
+    //  @selftest
+    {
+        printf ("      Parse ... \n");
+        const char *json =
+            "{ \"name\" : \"a\\\"b\", \"list\": [1, true, {\"x\\/y\": null}], \"empty\": {}, \"none\": [] }";
+        const char *expected[] = {
+            "name=\"a\\\"b\"",
+            "list/0=1",
+            "list/1=true",
+            "list/2/x/y=null",
+            "empty=(null)",
+            "none=(null)",
+            NULL
+        };
+        zlist_t *parsed = zlist_new ();
+        zlist_t *viewed = zlist_new ();
+        zlist_autofree (parsed);
+        zlist_autofree (viewed);
+        assert (vsjson_parse (json, s_vsjson_test_callback, parsed, true) == 0);
+        assert (vsjson_parse_view (json, s_vsjson_test_view_callback, viewed, true) == 0);
+        const char *a = (const char *) zlist_first (parsed);
+        const char *b = (const char *) zlist_first (viewed);
+        for (int i = 0; expected[i]; i++) {
+            if (verbose) log_debug ("%s", a);
+            assert (a && streq (a, expected[i]));
+            assert (b && streq (b, expected[i]));
+            a = (const char *) zlist_next (parsed);
+            b = (const char *) zlist_next (viewed);
+        }
+        assert (!a && !b);
+        zlist_destroy (&parsed);
+        zlist_destroy (&viewed);
+
+        zlist_t *dummy = zlist_new ();
+        zlist_autofree (dummy);
+        assert (vsjson_parse_view ("{\"a\": 1,", s_vsjson_test_view_callback, dummy, true) != 0);
+        assert (vsjson_parse_view ("{\"a\" 1}", s_vsjson_test_view_callback, dummy, true) != 0);
+        assert (vsjson_parse_view ("[1] 2", s_vsjson_test_view_callback, dummy, true) != 0);
+        zlist_destroy (&dummy);
+        printf ("      OK\n");
+    }
+
+    {
+        printf ("      Long locator ... \n");
+        //  nested keys longer than the inline locator buffer
+        std::string json, locator;
+        for (int i = 0; i < 300; i++) {
+            json += "{\"key" + std::to_string (i) + "\":";
+            locator += (i ? "/key" : "key") + std::to_string (i);
+        }
+        json += "[1]";
+        json.append (300, '}');
+        locator += "/0=1";
+        assert (locator.size () > 1024);
+        zlist_t *parsed = zlist_new ();
+        zlist_t *viewed = zlist_new ();
+        zlist_autofree (parsed);
+        zlist_autofree (viewed);
+        assert (vsjson_parse (json.c_str (), s_vsjson_test_callback, parsed, true) == 0);
+        assert (vsjson_parse_view (json.c_str (), s_vsjson_test_view_callback, viewed, true) == 0);
+        assert (zlist_size (parsed) == 1 && zlist_size (viewed) == 1);
+        assert (locator == (const char *) zlist_first (parsed));
+        assert (locator == (const char *) zlist_first (viewed));
+        zlist_destroy (&parsed);
+        zlist_destroy (&viewed);
+        printf ("      OK\n");
+    }
+
+    {
+        printf ("      Decode ... \n");
+        char *decoded = vsjson_decode_nstring ("\"plain\"xxx", 7);
+        assert (decoded && streq (decoded, "plain"));
+        zstr_free (&decoded);
+        decoded = vsjson_decode_string ("\"tab\\there\\\\\"");
+        assert (decoded && streq (decoded, "tab\there\\"));
+        zstr_free (&decoded);
+        assert (vsjson_decode_string ("42") == NULL);
+        assert (vsjson_decode_string ("\"") == NULL);
+        printf ("      OK\n");
+    }
+    //  @end
+    printf ("OK\n");
 }
 
 void rule_test_json(const char *dir, const char *basename)
@@ -958,6 +1802,28 @@ void rule_test_json(const char *dir, const char *basename)
         assert(0);
     }
 
+    // compact wire form carries the same rule
+    char *compact = rule_json_format (self, true, true);
+    assert (compact && !strchr (compact, '\n'));
+    rule_t *rule3 = rule_new ();
+    assert (rule_parse (rule3, compact) == 0);
+    char *json3 = rule_json (rule3);
+    assert (json3 && streq (json, json3));
+    zstr_free (&json3);
+    rule_destroy (&rule3);
+
+    // cached form follows changes of rule
+    size_t size;
+    const char *cached = rule_json_cached (self, true, &size);
+    assert (cached && size == strlen (compact) && memcmp (cached, compact, size) == 0);
+    assert (rule_json_cached (self, true, &size) == cached);
+    cached = rule_json_cached (self, false, &size);
+    assert (cached[0] == '{' && cached[size - 1] == '}');
+    rule_add_result_action (self, "cached", "EMAIL");
+    cached = rule_json_cached (self, true, &size);
+    assert (cached && strstr (cached, "\"cached\""));
+    zstr_free (&compact);
+
     zstr_free (&json);
     zstr_free (&json2);
     rule_destroy (&rule);
@@ -1083,6 +1949,13 @@ rule_test (bool verbose)
     {
         printf ("      Load test #4 - old json format ... \n");
         rule_test_json (SELFTEST_DIR_RULES, "old");
+
+        // scalar is not a list item
+        rule_t *self = rule_new ();
+        assert (rule_parse (self, "{\"name\":\"scalar\",\"assets\":\"ups-1\",\"groups\":\"g\",\"models\":\"m\",\"types\":\"t\"}") == 0);
+        assert (!rule_asset_first (self) && !rule_group_first (self));
+        assert (!rule_model_exists (self, "m") && !rule_type_exists (self, "t"));
+        rule_destroy (&self);
         printf ("      OK\n");
     }
 
@@ -1126,6 +1999,178 @@ rule_test (bool verbose)
         printf ("      OK\n");
     }
 
+    //  Evaluate test #6 - params and NAME/INAME binding
+    {
+        printf ("      Evaluate test #6 ... \n");
+        rule_t *self = rule_new ();
+        int r = rule_parse (self, "{\"name\":\"eval\",\"evaluation\":\"function main(a, b) return OK, NAME .. '/' .. INAME .. ':' .. a .. b end\"}");
+        assert (r == 0);
+
+        const char *params[] = { "1", "2" };
+        int result = RULE_ERROR;
+        const char *message = NULL;
+        rule_evaluate (self, params, 2, "ups-1", "UPS", &result, &message);
+        assert (result == 0);
+        assert (message && streq (message, "UPS/ups-1:12"));
+
+        params[1] = "3";
+        rule_evaluate (self, params, 2, "ups-1", "UPS", &result, &message);
+        assert (message && streq (message, "UPS/ups-1:13"));
+
+        rule_evaluate (self, params, 2, "ups-2", NULL, &result, &message);
+        assert (message && streq (message, "ups-2/ups-2:13"));
+
+        rule_destroy (&self);
+        printf ("      OK\n");
+    }
+
+    //  Evaluate test #7 - shared lua VM
+    {
+        printf ("      Evaluate test #7 - shared lua VM ... \n");
+        rule_set_shared_vms (1);
+        rule_t *rule1 = rule_new ();
+        rule_t *rule2 = rule_new ();
+        assert (rule_parse (rule1, "{\"name\":\"one\",\"evaluation\":\"X = 'one' function main() return WARNING, X .. NAME end\"}") == 0);
+        assert (rule_parse (rule2, "{\"name\":\"two\",\"evaluation\":\"X = 'two' function main() return OK, X .. NAME end\"}") == 0);
+
+        int result = RULE_ERROR;
+        const char *message = NULL;
+        rule_evaluate (rule1, NULL, 0, "ups-1", NULL, &result, &message);
+        assert (result == 1 && streq (message, "oneups-1"));
+        rule_evaluate (rule2, NULL, 0, "ups-2", NULL, &result, &message);
+        assert (result == 0 && streq (message, "twoups-2"));
+        rule_evaluate (rule1, NULL, 0, "ups-1", NULL, &result, &message);
+        assert (result == 1 && streq (message, "oneups-1"));
+        assert (rule_lua_memory (rule1) > 0);
+        assert (rule_lua_memory (rule1) == rule_lua_memory (rule2));
+
+        rule_destroy (&rule1);
+        rule_evaluate (rule2, NULL, 0, "ups-2", NULL, &result, &message);
+        assert (result == 0 && streq (message, "twoups-2"));
+        rule_destroy (&rule2);
+        rule_set_shared_vms (0);
+        printf ("      OK\n");
+    }
+
+    //  Evaluate test #8 - bytecode cache
+    {
+        printf ("      Evaluate test #8 - bytecode cache ... \n");
+        rule_set_bytecode_cache (SELFTEST_DIR_RW "/bytecode");
+        const char *json1 = "{\"name\":\"cached\",\"evaluation\":\"function main() return OK, 'one' end\"}";
+        const char *json2 = "{\"name\":\"cached\",\"evaluation\":\"function main() return OK, 'two' end\"}";
+        const char *expected[] = { "one", "one", "two" };
+        const char *jsons[] = { json1, json1, json2 };
+
+        // file name can't escape the cache directory
+        char *path = s_bytecode_path ("../cached");
+        assert (strncmp (path, SELFTEST_DIR_RW "/bytecode/", strlen (SELFTEST_DIR_RW "/bytecode/")) == 0);
+        assert (!strchr (path + strlen (SELFTEST_DIR_RW "/bytecode/"), '/'));
+        zstr_free (&path);
+
+        // compile from source, load from cache, changed source
+        path = s_bytecode_path ("cached");
+        for (int i = 0; i < 3; i++) {
+            rule_t *self = rule_new ();
+            assert (rule_parse (self, jsons[i]) == 0);
+            int result = RULE_ERROR;
+            const char *message = NULL;
+            rule_evaluate (self, NULL, 0, "ups-1", NULL, &result, &message);
+            assert (result == 0 && streq (message, expected[i]));
+            assert (zsys_file_exists (path));
+            rule_destroy (&self);
+        }
+
+        rule_bytecode_remove ("cached");
+        assert (!zsys_file_exists (path));
+        zstr_free (&path);
+        rule_set_bytecode_cache (NULL);
+        zsys_dir_delete (SELFTEST_DIR_RW "/bytecode");
+        printf ("      OK\n");
+    }
+
+    //  Evaluate test #9 - evaluation statistics
+    {
+        printf ("      Evaluate test #9 - evaluation statistics ... \n");
+        rule_t *self = rule_new ();
+        assert (rule_parse (self, "{\"name\":\"stats\",\"evaluation\":\"function main(a) if a == 'x' then error ('bad') end return OK, a end\"}") == 0);
+        assert (rule_lua_percentile (self, 50) == 0);
+
+        const char *params[] = { "1" };
+        int result = RULE_ERROR;
+        const char *message = NULL;
+        for (int i = 0; i < 10; i++)
+            rule_evaluate (self, params, 1, "ups-1", NULL, &result, &message);
+        params[0] = "x";
+        rule_evaluate (self, params, 1, "ups-1", NULL, &result, &message);
+        assert (result == RULE_ERROR);
+
+        uint64_t evaluations, errors, lua_usecs;
+        rule_eval_stats (self, &evaluations, &errors, &lua_usecs);
+        assert (evaluations == 11);
+        assert (errors == 1);
+        assert (rule_lua_percentile (self, 50) <= rule_lua_percentile (self, 99));
+        assert (rule_lua_percentile (self, 99) <= std::max<uint64_t> (lua_usecs, 1) * 5 / 4);
+
+        //  buckets are exact below 8 us, 4 per power of 2 above
+        assert (s_histogram_bucket (7) == 7 && s_histogram_upper (7) == 7);
+        assert (s_histogram_bucket (8) == 8 && s_histogram_upper (8) == 9);
+        assert (s_histogram_bucket (1000) == 35 && s_histogram_upper (35) == 1023);
+        assert (s_histogram_bucket ((uint64_t) 1 << 40) == RULE_HISTOGRAM_BUCKETS - 1);
+        rule_destroy (&self);
+        printf ("      OK\n");
+    }
+
+    //  Evaluate test #10 - lua budget
+    {
+        printf ("      Evaluate test #10 - lua budget ... \n");
+        rule_set_lua_budget (100000, 0);
+        rule_t *self = rule_new ();
+        // errors caught by the rule itself must not stop the budget
+        assert (rule_parse (self, "{\"name\":\"endless\",\"evaluation\":\"function main() while true do pcall (function () while true do end end) end end\"}") == 0);
+        int result = 0;
+        const char *message = NULL;
+        for (int i = 1; i <= RULE_BUDGET_STRIKES; i++) {
+            assert (!rule_quarantined (self));
+            assert (rule_lua_key (self));
+            rule_evaluate (self, NULL, 0, "ups-1", NULL, &result, &message);
+            assert (result == RULE_ERROR);
+            assert (rule_budget_exceeded (self) == (uint64_t) i);
+        }
+        assert (rule_quarantined (self));
+        assert (!rule_lua_key (self));
+        assert (rule_lua_memory (self) > 0);
+        rule_lua_release (self);
+        assert (rule_lua_memory (self) == 0);
+        rule_evaluate (self, NULL, 0, "ups-1", NULL, &result, &message);
+        uint64_t evaluations;
+        rule_eval_stats (self, &evaluations, NULL, NULL);
+        assert (evaluations == RULE_BUDGET_STRIKES);
+        rule_destroy (&self);
+
+        rule_set_lua_budget (0, RULE_LUA_MEMORY_MIN);
+        self = rule_new ();
+        assert (rule_parse (self, "{\"name\":\"greedy\",\"evaluation\":\"t = {} function main() for i = 1, 100000 do t[i] = string.rep ('x', 1000) .. i end return OK, '' end\"}") == 0);
+        rule_evaluate (self, NULL, 0, "ups-1", NULL, &result, &message);
+        assert (result == RULE_ERROR);
+        assert (rule_budget_exceeded (self) == 1);
+        assert (!rule_quarantined (self));
+        // VM is still usable after the failed allocation
+        assert (rule_lua_memory (self) <= RULE_LUA_MEMORY_MIN);
+        rule_destroy (&self);
+
+        // rules within budget are not affected
+        rule_set_lua_budget (100000, RULE_LUA_MEMORY_MIN);
+        self = rule_new ();
+        assert (rule_parse (self, "{\"name\":\"modest\",\"evaluation\":\"function main(a) local s = 0 for i = 1, 1000 do s = s + i end return OK, a .. s end\"}") == 0);
+        const char *params[] = { "sum " };
+        rule_evaluate (self, params, 1, "ups-1", NULL, &result, &message);
+        assert (result == 0 && streq (message, "sum 500500"));
+        assert (rule_budget_exceeded (self) == 0);
+        rule_destroy (&self);
+        rule_set_lua_budget (RULE_LUA_INSTRUCTIONS, RULE_LUA_MEMORY);
+        printf ("      OK\n");
+    }
+
     //  @end
     printf ("OK\n");
 }
@@ -27,6 +27,21 @@ extern "C" {
 #endif
 
 #define RULE_ERROR 255
+//  Maximum count of metrics passed to rule evaluation
+#define RULE_MAX_PARAMS 64
+//  Maximum count of shared lua VMs
+#define RULE_MAX_VMS 16
+//  Buckets of lua call time histogram of a rule
+#define RULE_HISTOGRAM_BUCKETS 96
+//  Default lua budget of one rule call
+#define RULE_LUA_INSTRUCTIONS 1000000
+#define RULE_LUA_MEMORY (16 * 1024 * 1024)
+#define RULE_LUA_MEMORY_MIN (256 * 1024)
+//  Kinds of budget a lua call can exceed
+#define RULE_BUDGET_INSTRUCTIONS 1
+#define RULE_BUDGET_MEMORY 2
+//  Calls over budget after which the rule is quarantined
+#define RULE_BUDGET_STRIKES 3
 
 //  Opaque class structures to allow forward references
 #ifndef RULE_T_DEFINED
@@ -91,6 +106,38 @@ FTY_ALERT_FLEXIBLE_PRIVATE bool
 FTY_ALERT_FLEXIBLE_PRIVATE bool
     rule_type_exists (rule_t *self, const char *type);
 
+//  Return the first asset. If there are no assets, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_asset_first (rule_t *self);
+
+//  Return the next asset. If there are no (more) assets, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_asset_next (rule_t *self);
+
+//  Return the first group. If there are no groups, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_group_first (rule_t *self);
+
+//  Return the next group. If there are no (more) groups, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_group_next (rule_t *self);
+
+//  Return the first model. If there are no models, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_model_first (rule_t *self);
+
+//  Return the next model. If there are no (more) models, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_model_next (rule_t *self);
+
+//  Return the first type. If there are no types, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_type_first (rule_t *self);
+
+//  Return the next type. If there are no (more) types, returns NULL.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_type_next (rule_t *self);
+
 //  Get rule actions
 FTY_ALERT_FLEXIBLE_PRIVATE zlist_t *
     rule_result_actions (rule_t *self, int result);
@@ -117,9 +164,78 @@ FTY_ALERT_FLEXIBLE_PRIVATE int
 FTY_ALERT_FLEXIBLE_PRIVATE char *
     rule_json (rule_t *self);
 
-//  Evaluate rule
+//  Convert rule to json, compact json has no newlines, envelope wraps it
+//  in { "flexible": ... }
+//  Caller is responsible for destroying the return value
+FTY_ALERT_FLEXIBLE_PRIVATE char *
+    rule_json_format (rule_t *self, bool compact, bool envelope);
+
+//  Compact json of rule, cached until the rule changes. Buffer is owned
+//  by rule and not NUL terminated, size is set to its length.
+FTY_ALERT_FLEXIBLE_PRIVATE const char *
+    rule_json_cached (rule_t *self, bool envelope, size_t *size);
+
+//  Evaluate rule with count params borrowed from caller
+//  Message is valid until the next evaluation of this rule
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_evaluate (rule_t *self, const char **params, int count, const char *iname, const char *ename, int *result, const char **message);
+
+//  Evaluation statistics of rule: lua calls, failed ones among them and
+//  total time spent in them. NULL pointers are skipped.
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_eval_stats (rule_t *self, uint64_t *evaluations, uint64_t *errors, uint64_t *lua_usecs);
+
+//  Lua call time (us) within which percent of evaluations of rule completed.
+//  Estimated from a histogram, 0 when rule was not evaluated.
+FTY_ALERT_FLEXIBLE_PRIVATE uint64_t
+    rule_lua_percentile (rule_t *self, int percent);
+
+//  Set lua budget of every rule call: instructions run and heap size in
+//  bytes of the VM (per rule for shared VMs). 0 disables the limit.
 FTY_ALERT_FLEXIBLE_PRIVATE void
-    rule_evaluate (rule_t *self, zlist_t *params, const char *iname, const char *ename, int *result, char **message);
+    rule_set_lua_budget (int instructions, size_t memory);
+
+//  Count of lua calls of rule stopped for going over budget
+FTY_ALERT_FLEXIBLE_PRIVATE uint64_t
+    rule_budget_exceeded (rule_t *self);
+
+//  True when rule went over budget RULE_BUDGET_STRIKES times. Quarantined
+//  rules are not evaluated anymore.
+FTY_ALERT_FLEXIBLE_PRIVATE bool
+    rule_quarantined (rule_t *self);
+
+//  Set count of shared lua VMs used by rules compiled from now on.
+//  0 (default) gives every rule its own VM. Rules sharing a VM have their
+//  own globals but share library tables, they are not isolated from each
+//  other.
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_set_shared_vms (int count);
+
+//  Set directory where compiled evaluation chunks are cached, NULL or ""
+//  (default) disables the cache.
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_set_bytecode_cache (const char *dir);
+
+//  Remove cached evaluation chunk of rule name, if any. Called when the
+//  rule is deleted.
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_bytecode_remove (const char *name);
+
+//  Return memory in bytes used by lua VM of the rule, 0 if not compiled.
+//  Shared VMs report memory of all their rules.
+FTY_ALERT_FLEXIBLE_PRIVATE size_t
+    rule_lua_memory (rule_t *self);
+
+//  Release lua context of the rule, it is compiled again when needed.
+//  Must not run concurrently with evaluations, see rule_lua_key.
+FTY_ALERT_FLEXIBLE_PRIVATE void
+    rule_lua_release (rule_t *self);
+
+//  Compile rule when needed and return its lua state as an opaque key.
+//  Rules with the same key must not be evaluated concurrently. NULL if the
+//  rule does not compile.
+FTY_ALERT_FLEXIBLE_PRIVATE const void *
+    rule_lua_key (rule_t *self);
 
 //  @end
 
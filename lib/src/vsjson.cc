@@ -14,66 +14,83 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <assert.h>
 #include <ctype.h>
 
 #define VSJSON_SEPARATOR '/'
+#define VSJSON_LOCATOR_INLINE 1024
+
+//  The parser does not copy its input. Tokens are (pointer, length) views
+//  into the original json text and the locator is built in place, in an
+//  inline buffer moved to heap for long paths, truncated back to the parent
+//  prefix after each member.
 
 struct _vsjson_t {
-    int state;
+    const char *text;
     const char *cursor;
-    char *text;
-    char *token;
-    int tokensize;
+    const char *token;
+    size_t tokenlen;
+    char *tokenbuf;     // NUL terminated token copy for vsjson_callback_t
+    size_t tokensize;
+    char *locator;      // locator_inline or heap buffer
+    size_t locatorsize;
+    size_t locatorlen;
+    char locator_inline[VSJSON_LOCATOR_INLINE];
+    vsjson_callback_t *func;
+    vsjson_view_callback_t *view_func;
+    void *data;
+    bool callWhenEmpty;
 };
 
 typedef struct _vsjson_t vsjson_t;
 
-static vsjson_t *vsjson_new (const char *json)
+static void vsjson_init (vsjson_t *self, const char *json, void *data, bool callWhenEmpty)
 {
-    if (!json) return NULL;
-    vsjson_t *self = (vsjson_t *) malloc (sizeof (vsjson_t));
-    if (!self) return NULL;
-
-    memset(self, 0, sizeof(vsjson_t));
-    self->text = strdup (json);
-    return self;
+    memset (self, 0, sizeof (vsjson_t));
+    self->text = json;
+    self->cursor = json;
+    self->data = data;
+    self->callWhenEmpty = callWhenEmpty;
+    self->locator = self->locator_inline;
+    self->locatorsize = VSJSON_LOCATOR_INLINE;
 }
 
-static const char *_vsjson_set_token (vsjson_t *self, const char *ptr, size_t len)
+static void vsjson_fini (vsjson_t *self)
 {
-    if (!ptr || !self) return NULL;
+    free (self->tokenbuf);
+    if (self->locator != self->locator_inline)
+        free (self->locator);
+}
 
-    if (!len) len = strlen (ptr);
-    if (self->tokensize > (int) len + 1) {
-        // fits in
-        strncpy (self->token, ptr, len);
-        self->token[len] = 0;
-        return self->token;
-    }
-    if (self->token) {
-        free (self->token);
-        self->token = NULL;
-        self->tokensize = 0;
-    }
-    self->token = (char *) malloc (len + 1);
-    if (!self->token) return NULL;
-    strncpy (self->token, ptr, len);
-    self->token[len] = 0;
-    self->tokensize = len+1;
-    return self->token;
+//  Make room for locator of size bytes, NUL included
+static int _vsjson_locator_reserve (vsjson_t *self, size_t size)
+{
+    if (size <= self->locatorsize) return 0;
+    size_t newsize = self->locatorsize;
+    while (newsize < size) newsize *= 2;
+    char *buffer = (char *) malloc (newsize);
+    if (!buffer) return -2;
+    memcpy (buffer, self->locator, self->locatorlen + 1);
+    if (self->locator != self->locator_inline)
+        free (self->locator);
+    self->locator = buffer;
+    self->locatorsize = newsize;
+    return 0;
 }
 
-static const char* _vsjson_seek_to_next_token(vsjson_t *self)
+static const char *_vsjson_set_token (vsjson_t *self, const char *ptr, size_t len)
 {
-    if (!self) return NULL;
+    if (!ptr || !self) return NULL;
 
-    while (true) {
-        if (self->cursor == NULL) return NULL;
-        if (! isspace (self->cursor[0])) return self->cursor;
-        self->cursor++;
+    if (self->tokensize < len + 1) {
+        char *buffer = (char *) realloc (self->tokenbuf, len + 1);
+        if (!buffer) return NULL;
+        self->tokenbuf = buffer;
+        self->tokensize = len + 1;
     }
+    memcpy (self->tokenbuf, ptr, len);
+    self->tokenbuf[len] = 0;
+    return self->tokenbuf;
 }
 
 static const char* _vsjson_find_next_token(vsjson_t *self, const char *start)
@@ -167,149 +184,201 @@ static const char* _vsjson_find_token_end(vsjson_t *self, const char *start)
 
 static int vsjson_is_token_valid (vsjson_t *self)
 {
-    if (!self || !self -> token) return 0;
-    if (strchr ("{}[]:,",self->token[0]) && (self->token[1] == 0)) {
+    if (!self || !self->token || !self->tokenlen) return 0;
+
+    const char *token = self->token;
+    size_t len = self->tokenlen;
+    if (len == 1 && strchr ("{}[]:,", token[0])) {
         return 1;
     }
-    if (strchr ("+-0123456789", self -> token [0])) {
+    if (strchr ("+-0123456789", token [0])) {
         // TODO: validate json number?
         return 1;
     }
-    switch (self->token[0]) {
+    switch (token[0]) {
     case '"':
-        if (self->token [strlen (self -> token)-1] == '"' && strlen (self -> token) >= 2) {
-            return 1;
-        }
-        return 0;
+        return len >= 2 && token [len - 1] == '"';
     case 't':
-        if (strcmp (self -> token, "true") == 0) return 1;
+        return len == 4 && memcmp (token, "true", 4) == 0;
     case 'f':
-        if (strcmp (self -> token, "false") == 0) return 1;
+        return len == 5 && memcmp (token, "false", 5) == 0;
     case 'n':
-        if (strcmp (self -> token, "null") == 0) return 1;
+        return len == 4 && memcmp (token, "null", 4) == 0;
     }
     return 0;
 }
 
-static const char* vsjson_first_token (vsjson_t *self)
+static const char* vsjson_next_token (vsjson_t *self)
 {
     if (!self) return NULL;
-    self->cursor = _vsjson_find_next_token (self, NULL);
+    self->token = NULL;
+    self->tokenlen = 0;
+    if (!self->cursor) return NULL;
+    self->cursor = _vsjson_find_next_token (self, self->cursor);
     if (!self->cursor) return NULL;
     const char *p = _vsjson_find_token_end (self, self->cursor);
     if (p) {
-        _vsjson_set_token (self, self->cursor, p - self->cursor);
+        self->token = self->cursor;
+        self->tokenlen = p - self->cursor;
         self->cursor = p;
         return self->token;
     }
     return NULL;
 }
 
-static const char* vsjson_next_token (vsjson_t *self)
+//  Unescape len bytes of a json string body (without quotes) into dst,
+//  which must have room for len + 1 bytes. Returns the decoded length.
+
+static size_t _vsjson_unescape (const char *src, size_t len, char *dst)
 {
-    if (!self) return NULL;
-    self->cursor = _vsjson_find_next_token (self, self->cursor);
-    if (!self->cursor) return NULL;
-    const char *p = _vsjson_find_token_end (self, self->cursor);
-    if (p) {
-        _vsjson_set_token (self, self->cursor, p - self->cursor);
-        self->cursor = p;
-        return self->token;
+    const char *end = src + len;
+    char *p = dst;
+
+    while (src < end) {
+        if (*src != '\\') {
+            *p++ = *src++;
+            continue;
+        }
+        if (++src == end) break;
+        switch (*src) {
+        case '\\':
+        case '/':
+        case '"':
+            *p++ = *src;
+            break;
+        case 'b':
+            *p++ = '\b';
+            break;
+        case 'f':
+            *p++ = '\f';
+            break;
+        case 'n':
+            *p++ = '\n';
+            break;
+        case 'r':
+            *p++ = '\r';
+            break;
+        case 't':
+            *p++ = '\t';
+            break;
+        //TODO \uXXXX
+        }
+        ++src;
     }
-    return NULL;
+    *p = 0;
+    return p - dst;
+}
+
+//  Replace the locator past prefixlen with /key, key being a json string
+//  token. Keys without escapes are copied as they are.
+
+static int _vsjson_locator_key (vsjson_t *self, size_t prefixlen, const char *key, size_t len)
+{
+    // key is "...", decoded key is never longer than its body
+    if (_vsjson_locator_reserve (self, prefixlen + len) != 0) return -2;
+
+    char *dst = &self->locator[prefixlen];
+    *dst++ = VSJSON_SEPARATOR;
+    const char *body = key + 1;
+    size_t bodylen = len - 2;
+    if (memchr (body, '\\', bodylen)) {
+        bodylen = _vsjson_unescape (body, bodylen, dst);
+    }
+    else {
+        memcpy (dst, body, bodylen);
+        dst[bodylen] = 0;
+    }
+    self->locatorlen = prefixlen + 1 + bodylen;
+    return 0;
+}
+
+static int _vsjson_locator_index (vsjson_t *self, size_t prefixlen, int index)
+{
+    // separator, up to 11 chars of int and NUL
+    if (_vsjson_locator_reserve (self, prefixlen + 13) != 0) return -2;
+    size_t room = self->locatorsize - prefixlen;
+    int n = snprintf (&self->locator[prefixlen], room, "%c%i", VSJSON_SEPARATOR, index);
+    if (n < 0 || (size_t) n >= room) return -2;
+    self->locatorlen = prefixlen + n;
+    return 0;
+}
+
+static void _vsjson_locator_truncate (vsjson_t *self, size_t prefixlen)
+{
+    self->locatorlen = prefixlen;
+    self->locator[prefixlen] = 0;
 }
 
-static void vsjson_destroy (vsjson_t **self_p)
+static int _vsjson_emit (vsjson_t *self, const char *value, size_t len)
 {
-    if (!self_p) return;
-    if (!*self_p) return;
-    vsjson_t *self = *self_p;
-    if (self->text) free (self->text);
-    if (self->token) free (self->token);
-    free (self);
-    *self_p = NULL;
+    const char *locator = self->locatorlen ? &self->locator[1] : "";
+
+    if (self->view_func)
+        return self->view_func (locator, value, len, self->data);
+    if (!value)
+        return self->func (locator, NULL, self->data);
+    if (!_vsjson_set_token (self, value, len))
+        return -2;
+    return self->func (locator, self->tokenbuf, self->data);
 }
 
-static int _vsjson_walk_array (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty);
+static int _vsjson_walk_array (vsjson_t *self);
 
-static int _vsjson_walk_object (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+static int _vsjson_walk_object (vsjson_t *self)
 {
     int result = 0;
     int itemscount = 0;
-    char *locator = NULL;
-    char *key = NULL;
-    size_t s;
+    size_t prefixlen = self->locatorlen;
 
     const char *token = vsjson_next_token (self);
     while (token) {
         // token should be key or }
         switch (token[0]) {
         case '}':
-            if (itemscount == 0 && callWhenEmpty) {
-                result = func (&prefix[1], NULL, data);
+            if (itemscount == 0 && self->callWhenEmpty) {
+                result = _vsjson_emit (self, NULL, 0);
             }
-            goto cleanup;
+            return result;
         case '"':
-            key = vsjson_decode_string (token);
             ++itemscount;
+            if (!vsjson_is_token_valid (self)) return -3;
+            result = _vsjson_locator_key (self, prefixlen, token, self->tokenlen);
+            if (result != 0) return result;
             token = vsjson_next_token (self);
-            if (strcmp (token, ":") != 0) {
-                result = -1;
-                goto cleanup;
-            }
+            if (!token || token[0] != ':') return -1;
             token = vsjson_next_token (self);
-            if (!token) {
-                result = -1;
-                goto cleanup;
-            }
-            s = strlen (prefix) + strlen (key) + 2;
-            locator = (char *)malloc (s);
-            if (!locator) {
-                result = -2;
-                goto cleanup;
-            }
-            snprintf(locator, s, "%s%c%s", prefix, VSJSON_SEPARATOR, key);
+            if (!token) return -1;
             switch (token[0]) {
             case '{':
-                result = _vsjson_walk_object (self, locator, func, data, callWhenEmpty);
-                if (result != 0) goto cleanup;
+                result = _vsjson_walk_object (self);
                 break;
             case '[':
-                result = _vsjson_walk_array (self, locator, func, data, callWhenEmpty);
-                if (result != 0) goto cleanup;
+                result = _vsjson_walk_array (self);
                 break;
             case ':':
             case ',':
             case '}':
             case ']':
-                result = -1;
-                goto cleanup;
+                return -1;
             default:
                 // this is the value
                 if (vsjson_is_token_valid (self)) {
-                    result = func (&locator[1], token, data);
+                    result = _vsjson_emit (self, token, self->tokenlen);
                 } else {
                     result = -3;
                 }
-                if (result != 0) goto cleanup;
                 break;
             }
-            free (locator);
-            locator = NULL;
-            free (key);
-            key = NULL;
+            if (result != 0) return result;
+            _vsjson_locator_truncate (self, prefixlen);
             break;
         default:
             // this is wrong
-            result = -1;
-            goto cleanup;
+            return -1;
         }
         token = vsjson_next_token (self);
         // now the token can be only '}' or ','
-        if (!token) {
-            result = -1;
-            goto cleanup;
-        }
+        if (!token) return -1;
         switch (token[0]) {
         case ',':
             token = vsjson_next_token (self);
@@ -317,72 +386,57 @@ static int _vsjson_walk_object (vsjson_t *self, const char *prefix, vsjson_callb
         case '}':
             break;
         default:
-            result = -1;
-            goto cleanup;
+            return -1;
         }
     }
- cleanup:
-    if (locator) free (locator);
-    if (key) free (key);
-    return result;
+    // unterminated
+    return -1;
 }
 
-static int _vsjson_walk_array (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+static int _vsjson_walk_array (vsjson_t *self)
 {
     int index = 0;
     int result = 0;
-    char *locator = NULL;
+    size_t prefixlen = self->locatorlen;
 
     const char *token = vsjson_next_token (self);
     while (token) {
-        size_t s = strlen (prefix) + 1 + sizeof (index)*3 + 1;
-        locator = (char *) malloc (s);
-        if (!locator) {
-            result = -2;
-            goto cleanup;
-        }
-        snprintf(locator, s, "%s%c%i", prefix, VSJSON_SEPARATOR, index);
         // token should be value or ]
         switch (token[0]) {
         case ']':
-            if (index == 0 && callWhenEmpty) {
-                result = func (&prefix[1], NULL, data);
+            if (index == 0 && self->callWhenEmpty) {
+                result = _vsjson_emit (self, NULL, 0);
             }
-            goto cleanup;
+            return result;
         case ':':
         case ',':
         case '}':
-            result = -1;
-            goto cleanup;
+            return -1;
+        }
+        result = _vsjson_locator_index (self, prefixlen, index);
+        if (result != 0) return result;
+        switch (token[0]) {
         case '{':
-            result = _vsjson_walk_object (self, locator, func, data, callWhenEmpty);
-            ++index;
-            if (result != 0) goto cleanup;
+            result = _vsjson_walk_object (self);
             break;
         case '[':
-            result = _vsjson_walk_array (self, locator, func, data, callWhenEmpty);
-            ++index;
-            if (result != 0) goto cleanup;
+            result = _vsjson_walk_array (self);
             break;
         default:
             if (vsjson_is_token_valid (self)) {
-                result = func (&locator[1], token, data);
-                ++index;
+                result = _vsjson_emit (self, token, self->tokenlen);
             } else {
                 result = -3;
             }
-            if (result != 0) goto cleanup;
             break;
         }
-        free (locator);
-        locator = NULL;
+        if (result != 0) return result;
+        ++index;
+        _vsjson_locator_truncate (self, prefixlen);
 
         token = vsjson_next_token (self);
         // now the token can be only ']' or ','
-        if (!token) {
-            result = -1;
-            goto cleanup;
-        }
+        if (!token) return -1;
         switch (token[0]) {
         case ',':
             token = vsjson_next_token (self);
@@ -390,43 +444,41 @@ static int _vsjson_walk_array (vsjson_t *self, const char *prefix, vsjson_callba
         case ']':
             break;
         default:
-            result = -1;
-            goto cleanup;
+            return -1;
         }
     }
- cleanup:
-    if (locator) free (locator);
-    return result;
+    // unterminated
+    return -1;
 }
 
-static int vsjson_walk_trough (vsjson_t *self, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+static int vsjson_walk_trough (vsjson_t *self)
 {
-    if (!self || !func) return -1;
+    if (!self || !(self->func || self->view_func)) return -1;
 
     int result = 0;
 
-    const char *token = vsjson_first_token (self);
+    const char *token = vsjson_next_token (self);
     if (token) {
         switch (token[0]) {
         case '{':
-            result = _vsjson_walk_object (self, "", func, data, callWhenEmpty);
+            result = _vsjson_walk_object (self);
             break;
         case '[':
-            result = _vsjson_walk_array (self, "", func, data, callWhenEmpty);
+            result = _vsjson_walk_array (self);
             break;
         default:
             // this is simple json containing just string, number ...
             if (vsjson_is_token_valid (self)) {
-                result = func ("", token, data);
+                result = _vsjson_emit (self, token, self->tokenlen);
             } else {
                 result = -1;
             }
             break;
         }
     }
-    if (result == 0) {
-        token = vsjson_next_token (self);
-        if (token) result = -1;
+    if (result == 0 && self->cursor) {
+        // nothing but whitespace may follow
+        if (_vsjson_find_next_token (self, self->cursor)) result = -1;
     }
     return result;
 }
@@ -434,62 +486,30 @@ static int vsjson_walk_trough (vsjson_t *self, vsjson_callback_t *func, void *da
 char *vsjson_decode_string (const char *string)
 {
     if (!string) return NULL;
+    return vsjson_decode_nstring (string, strlen (string));
+}
 
-    char *decoded = (char *) malloc (strlen (string));
-    if (!decoded) return NULL;
-
-    memset (decoded, 0, strlen (string));
-    const char *src = string;
-    char *dst = decoded;
+char *vsjson_decode_nstring (const char *string, size_t len)
+{
+    if (!string) return NULL;
 
-    if (string[0] != '"' || string[strlen (string)-1] != '"') {
+    if (len < 2 || string[0] != '"' || string[len - 1] != '"') {
         // no quotes, this is not json string
-        free (decoded);
         return NULL;
     }
-    ++src;
-    while(*src) {
-        switch (*src) {
-        case '\\':
-            ++src;
-            switch (*src) {
-            case '\\':
-            case '/':
-            case '"':
-                *dst = *src;
-                ++dst;
-                break;
-            case 'b':
-                *dst = '\b';
-                ++dst;
-                break;
-            case 'f':
-                *dst = '\f';
-                ++dst;
-                break;
-            case 'n':
-                *dst = '\n';
-                ++dst;
-                break;
-            case 'r':
-                *dst = '\r';
-                ++dst;
-                break;
-            case 't':
-                *dst = '\t';
-                ++dst;
-                break;
-            //TODO \uXXXX
-            }
-            break;
-        default:
-            *dst = *src;
-            ++dst;
-        }
-        ++src;
+    const char *body = string + 1;
+    size_t bodylen = len - 2;
+
+    char *decoded = (char *) malloc (bodylen + 1);
+    if (!decoded) return NULL;
+
+    if (memchr (body, '\\', bodylen)) {
+        _vsjson_unescape (body, bodylen, decoded);
+    }
+    else {
+        memcpy (decoded, body, bodylen);
+        decoded[bodylen] = 0;
     }
-    --dst;
-    *dst = 0;
     return decoded;
 }
 
@@ -505,70 +525,73 @@ char *vsjson_encode_nstring (const char *string, size_t len)
 {
     if (!string) return NULL;
 
-    int capacity = len + 15;
-    int index = 1;
-    const char *p = string;
-
-    char * encoded = (char *) malloc (capacity);
+    char *encoded = (char *) malloc (2 * len + 3);
     if (!encoded) return NULL;
-    memset (encoded, 0, capacity);
-    encoded[0] = '"';
-    while (*p && p - string < (int) len) {
-        switch (*p) {
+    size_t n = vsjson_encode_nstring_to (string, len, encoded);
+    encoded [n] = 0;
+    return encoded;
+}
+
+size_t vsjson_encode_nstring_to (const char *string, size_t len, char *dst)
+{
+    char *p = dst;
+    *p++ = '"';
+    for (const char *src = string; src && src < string + len && *src; src++) {
+        switch (*src) {
         case '"':
         case '\\':
         case '/':
-            encoded[index++] = '\\';
-            encoded[index++] = *p;
+            *p++ = '\\';
+            *p++ = *src;
             break;
         case '\b':
-            encoded[index++] = '\\';
-            encoded[index++] = 'b';
+            *p++ = '\\';
+            *p++ = 'b';
             break;
         case '\f':
-            encoded[index++] = '\\';
-            encoded[index++] = 'f';
+            *p++ = '\\';
+            *p++ = 'f';
             break;
         case '\n':
-            encoded[index++] = '\\';
-            encoded[index++] = 'n';
+            *p++ = '\\';
+            *p++ = 'n';
             break;
         case '\r':
-            encoded[index++] = '\\';
-            encoded[index++] = 'r';
+            *p++ = '\\';
+            *p++ = 'r';
             break;
         case '\t':
-            encoded[index++] = '\\';
-            encoded[index++] = 't';
+            *p++ = '\\';
+            *p++ = 't';
             break;
         default:
-            encoded[index++] = *p;
+            *p++ = *src;
             break;
         //TODO \uXXXX
         }
-        p++;
-        if (capacity - index < 10) {
-            int add = len - (p - string) + 15;
-            char *ne = (char *) realloc (encoded, capacity + add);
-            if (ne) {
-                encoded = ne;
-                memset (&encoded[capacity], 0, add);
-                capacity += add;
-            }else {
-                free (encoded);
-                return NULL;
-            }
-        }
     }
-    encoded [index] = '"';
-    return encoded;
+    *p++ = '"';
+    return p - dst;
 }
 
 int vsjson_parse (const char *json, vsjson_callback_t *func, void *data, bool callWhenEmpty)
 {
     if (!json || !func) return -1;
-    vsjson_t *v = vsjson_new (json);
-    int r = vsjson_walk_trough (v, func, data, callWhenEmpty);
-    vsjson_destroy (&v);
+    vsjson_t v;
+    vsjson_init (&v, json, data, callWhenEmpty);
+    v.func = func;
+    int r = vsjson_walk_trough (&v);
+    vsjson_fini (&v);
+    return r;
+}
+
+int vsjson_parse_view (const char *json, vsjson_view_callback_t *func, void *data, bool callWhenEmpty)
+{
+    if (!json || !func) return -1;
+    vsjson_t v;
+    vsjson_init (&v, json, data, callWhenEmpty);
+    v.view_func = func;
+    int r = vsjson_walk_trough (&v);
+    vsjson_fini (&v);
     return r;
 }
@@ -17,18 +17,32 @@ extern "C" {
 
 typedef int (vsjson_callback_t)(const char *locator, const char *value, void *data);
 
+// value is a view of len bytes into the parsed json, it is not NUL terminated
+typedef int (vsjson_view_callback_t)(const char *locator, const char *value, size_t len, void *data);
+
 FTY_ALERT_FLEXIBLE_PRIVATE int
     vsjson_parse (const char *json, vsjson_callback_t *func, void *data, bool callWhenEmpty);
 
+FTY_ALERT_FLEXIBLE_PRIVATE int
+    vsjson_parse_view (const char *json, vsjson_view_callback_t *func, void *data, bool callWhenEmpty);
+
 FTY_ALERT_FLEXIBLE_PRIVATE char*
     vsjson_decode_string (const char *string);
 
+FTY_ALERT_FLEXIBLE_PRIVATE char*
+    vsjson_decode_nstring (const char *string, size_t len);
+
 FTY_ALERT_FLEXIBLE_PRIVATE char*
     vsjson_encode_string (const char *string);
 
 FTY_ALERT_FLEXIBLE_PRIVATE char*
     vsjson_encode_nstring (const char *string, size_t len);
 
+// encode into dst, which must have room for 2 * len + 2 bytes; the result
+// is not NUL terminated, returns its length
+FTY_ALERT_FLEXIBLE_PRIVATE size_t
+    vsjson_encode_nstring_to (const char *string, size_t len, char *dst);
+
 #ifdef __cplusplus
 }
 #endif
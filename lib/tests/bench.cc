@@ -0,0 +1,148 @@
+/*  ========================================================================
+    Copyright (C) 2020 Eaton
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    ========================================================================
+*/
+
+/*
+@header
+    fty-alert-flexible-bench - benchmark of the evaluation pipeline
+@discuss
+    Runs the pipeline in process against a synthetic inventory. SHM store,
+    rule files and audit log live in a temporary directory removed at exit,
+    alerts go through an inproc malamute broker. Rule operations are
+    micro-benchmarked by the test build instead, see bench_rule.cc.
+@end
+*/
+
+#include <filesystem>
+#include "../src/fty_alert_flexible_classes.h"
+#include "bench.h"
+
+#define RULES_DIR   "selftest-ro/rules"
+#define TEMP_DIR    "/tmp/fty-alert-flexible-bench-XXXXXX"
+
+//  Console gets warnings only, audit log is written like in production
+static const char *s_logging_cfg =
+    "log4cplus.rootLogger=WARN, console\n"
+    "log4cplus.appender.console=log4cplus::ConsoleAppender\n"
+    "log4cplus.appender.console.layout=log4cplus::PatternLayout\n"
+    "log4cplus.appender.console.layout.ConversionPattern=%%D{%%Y-%%m-%%d %%H:%%M:%%S} %%c [%%-5p] %%F:%%L %%m%%n\n"
+    "log4cplus.logger.alerts-flexible-audit=INFO, audit\n"
+    "log4cplus.additivity.alerts-flexible-audit=false\n"
+    "log4cplus.appender.audit=log4cplus::RollingFileAppender\n"
+    "log4cplus.appender.audit.File=%s/alarms-audit.log\n"
+    "log4cplus.appender.audit.MaxFileSize=16MB\n"
+    "log4cplus.appender.audit.MaxBackupIndex=1\n"
+    "log4cplus.appender.audit.layout=log4cplus::PatternLayout\n"
+    "log4cplus.appender.audit.layout.ConversionPattern=%%D{%%Y-%%m-%%d %%H:%%M:%%S} %%c [%%-5p] %%F:%%L %%m%%n\n";
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    const char *rules = RULES_DIR;
+    int instances = 1000;
+    int rounds = 20;
+    int changes = 10;
+    int workers = 1;
+    int batch = 0;
+    int lua_vms = 0;
+
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *param = NULL;
+        if (argn < argc - 1) param = argv [argn+1];
+
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("fty-alert-flexible-bench [options] ...");
+            puts ("  -v|--verbose          verbose logging");
+            puts ("  -h|--help             this information");
+            puts ("  -r|--rules            directory with rules and templates/ [" RULES_DIR "]");
+            puts ("  -n|--instances        instances of every template [1000]");
+            puts ("  -R|--rounds           measured SHM polls [20]");
+            puts ("  -c|--changes          percent of assets changing state every round [10]");
+            puts ("  -w|--workers          threads evaluating SHM metrics [1]");
+            puts ("  -b|--batch            alerts batch size, 0 = no batching [0]");
+            puts ("  -l|--lua-vms          count of lua VMs shared by rules, 0 = one VM per rule [0]");
+            return 0;
+        }
+        else if (streq (argv [argn], "--verbose") || streq (argv [argn], "-v")) {
+            verbose = true;
+        }
+        else if (streq (argv [argn], "--rules") || streq (argv [argn], "-r")) {
+            if (param) rules = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--instances") || streq (argv [argn], "-n")) {
+            if (param) instances = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--rounds") || streq (argv [argn], "-R")) {
+            if (param) rounds = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--changes") || streq (argv [argn], "-c")) {
+            if (param) changes = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--workers") || streq (argv [argn], "-w")) {
+            if (param) workers = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--batch") || streq (argv [argn], "-b")) {
+            if (param) batch = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--lua-vms") || streq (argv [argn], "-l")) {
+            if (param) lua_vms = atoi (param);
+            ++argn;
+        }
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char work_dir [] = TEMP_DIR;
+    if (!mkdtemp (work_dir)) {
+        printf ("Cannot create temporary directory (%s)\n", strerror (errno));
+        return EXIT_FAILURE;
+    }
+
+    char *logging_cfg = zsys_sprintf ("%s/logging.cfg", work_dir);
+    FILE *f = fopen (logging_cfg, "w");
+    if (f) {
+        fprintf (f, s_logging_cfg, work_dir);
+        fclose (f);
+    }
+    ftylog_setInstance ("fty-alert-flexible-bench", logging_cfg);
+    if (verbose)
+        ftylog_setVerboseMode (ftylog_getInstance ());
+    AlertsFlexibleAuditLogManager::init (logging_cfg);
+    zstr_free (&logging_cfg);
+
+    char *shm_dir = zsys_sprintf ("%s/shm", work_dir);
+    zsys_dir_create ("%s", shm_dir);
+    fty_shm_set_test_dir (shm_dir);
+    zstr_free (&shm_dir);
+    rule_set_shared_vms (lua_vms);
+
+    printf ("fty-alert-flexible-bench (work dir: %s)\n", work_dir);
+    int rv = flexible_alert_bench (rules, work_dir, instances, rounds, changes, workers, batch);
+
+    AlertsFlexibleAuditLogManager::deinit ();
+    std::error_code ec;
+    std::filesystem::remove_all (work_dir, ec);
+    return rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,479 @@
+/*  ========================================================================
+    Copyright (C) 2020 Eaton
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    ========================================================================
+*/
+
+/*
+@header
+    bench_pipeline - benchmark of the evaluation pipeline
+@discuss
+    Drives flexible_alert without its actor, through the internals of
+    flexible_alert_private.h.
+@end
+*/
+
+#include "../src/flexible_alert_private.h"
+#include "bench.h"
+#include <dirent.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+
+//  Counting allocator. Only counts: every call is still forwarded to the
+//  glibc allocator, which does the work. malloc, calloc and realloc of the
+//  whole process are counted, operator new included as libstdc++ calls
+//  malloc. free is not hooked, and neither are posix_memalign, aligned_alloc
+//  and memalign, which the evaluation path doesn't use: allocations through
+//  those are missed. Other libcs count nothing.
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t nmemb, size_t size);
+void *__libc_realloc (void *ptr, size_t size);
+}
+
+static std::atomic<uint64_t> s_bench_allocs (0);
+
+extern "C" void *
+malloc (size_t size) __THROW
+{
+    s_bench_allocs.fetch_add (1, std::memory_order_relaxed);
+    return __libc_malloc (size);
+}
+
+extern "C" void *
+calloc (size_t nmemb, size_t size) __THROW
+{
+    s_bench_allocs.fetch_add (1, std::memory_order_relaxed);
+    return __libc_calloc (nmemb, size);
+}
+
+extern "C" void *
+realloc (void *ptr, size_t size) __THROW
+{
+    s_bench_allocs.fetch_add (1, std::memory_order_relaxed);
+    return __libc_realloc (ptr, size);
+}
+
+static uint64_t
+s_bench_alloc_count (void)
+{
+    return s_bench_allocs.load (std::memory_order_relaxed);
+}
+#else
+static uint64_t
+s_bench_alloc_count (void)
+{
+    return 0;
+}
+#endif
+
+//  --------------------------------------------------------------------------
+//  Benchmark of the evaluation pipeline. Rules of rules_dir are loaded with
+//  instances of its templates, each template being instantiated for
+//  "instances" synthetic assets (one rack controller only, as on a real
+//  system). Every round writes all metrics of the inventory to SHM, then
+//  polls and evaluates them the way the SHM polling path does. Metrics of
+//  "changes" percent of assets flip between normal and alarm values each
+//  round, so that their alerts are published. Alerts go through an inproc
+//  malamute broker to a consumer client, which measures their latency from
+//  the start of the poll. Round 0 compiles rules and publishes every alert
+//  once, it is reported apart. Rule files are written under work_dir, SHM
+//  test dir and logging are set up by the caller.
+//  Returns 0 on success, -1 if rules or templates can't be loaded.
+
+#define BENCH_ENDPOINT "inproc://fty-alert-flexible-bench"
+#define BENCH_METRIC_TTL 300
+#define BENCH_ALERTS_TIMEOUT 10000
+
+//  Template placeholders, NULL stands for the asset name. Placeholders
+//  containing others come first.
+static const char *s_bench_placeholders [][2] = {
+    { "__logicalasset_iname__", "rack-1" },
+    { "__logicalasset__", "Rack 1" },
+    { "__normalstate__", "good" },
+    { "__rule_result__", "warning" },
+    { "__severity__", "WARNING" },
+    { "__ename__", NULL },
+    { "__name__", NULL },
+    { "__port__", "GPI1" },
+};
+
+typedef struct {
+    std::string name;           // file name up to '@'
+    std::string subtype;        // from "__device_<subtype>__" in file name
+    std::string model;          // first model of the rule, "" if none
+    std::string json;
+} bench_template_t;
+
+typedef struct {
+    std::string name;
+    std::string subtype;
+    std::string model;
+    std::vector<std::string> metrics;
+    bool alarm;
+} bench_asset_t;
+
+static bool
+s_bench_read_file (const std::string &path, std::string &content)
+{
+    FILE *f = fopen (path.c_str (), "r");
+    if (!f) {
+        log_error ("can't open file %s (%s)", path.c_str (), strerror (errno));
+        return false;
+    }
+    char buffer [4096];
+    size_t n;
+    content.clear ();
+    while ((n = fread (buffer, 1, sizeof (buffer), f)) > 0)
+        content.append (buffer, n);
+    fclose (f);
+    return true;
+}
+
+static bool
+s_bench_write_file (const std::string &path, const std::string &content)
+{
+    FILE *f = fopen (path.c_str (), "w");
+    if (!f) {
+        log_error ("can't create file %s (%s)", path.c_str (), strerror (errno));
+        return false;
+    }
+    bool written = fwrite (content.data (), 1, content.size (), f) == content.size ();
+    return fclose (f) == 0 && written;
+}
+
+//  Returns template json with placeholders replaced for the asset
+static std::string
+s_bench_instance (const std::string &json, const char *assetname)
+{
+    std::string result = json;
+    for (auto &placeholder : s_bench_placeholders) {
+        const char *value = placeholder [1] ? placeholder [1] : assetname;
+        size_t len = strlen (placeholder [0]);
+        size_t pos = 0;
+        while ((pos = result.find (placeholder [0], pos)) != std::string::npos) {
+            result.replace (pos, len, value);
+            pos += strlen (value);
+        }
+    }
+    return result;
+}
+
+//  Normal and alarm values of metrics consumed by the fixture rules
+static const char *
+s_bench_value (const char *metric, bool alarm)
+{
+    if (streq (metric, "status.ups"))
+        return alarm ? "72" : "8";
+    if (streq (metric, "single-point-of-failure"))
+        return alarm ? "1" : "0";
+    if (streq (metric, "licensing.expire"))
+        return alarm ? "15" : "60";
+    return alarm ? "bad" : "good";
+}
+
+//  Returns field of /proc/self/status in kB, -1 if unknown
+static long
+s_bench_status_kb (const char *field)
+{
+    FILE *f = fopen ("/proc/self/status", "r");
+    if (!f) return -1;
+    long kb = -1;
+    size_t len = strlen (field);
+    char line [256];
+    while (fgets (line, sizeof (line), f)) {
+        if (strncmp (line, field, len) == 0 && line [len] == ':') {
+            kb = atol (line + len + 1);
+            break;
+        }
+    }
+    fclose (f);
+    return kb;
+}
+
+static int64_t
+s_bench_percentile (const std::vector<int64_t> &sorted, int percent)
+{
+    if (sorted.empty ()) return 0;
+    return sorted [std::min (sorted.size () * percent / 100, sorted.size () - 1)];
+}
+
+static double
+s_bench_rate (uint64_t count, int64_t usecs)
+{
+    return usecs > 0 ? (double) count * 1000000 / usecs : 0;
+}
+
+//  Read every <name>@__device_<subtype>__.rule of rules_dir/templates
+static void
+s_bench_templates (const char *rules_dir, std::vector<bench_template_t> &templates)
+{
+    std::string path = std::string (rules_dir) + "/templates";
+    DIR *dir = opendir (path.c_str ());
+    if (!dir) {
+        log_error ("cannot open dir '%s' (%s)", path.c_str (), strerror (errno));
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL) {
+        const char *at = strchr (entry->d_name, '@');
+        const char *subtype = at ? strstr (at, "__device_") : NULL;
+        const char *end = subtype ? strstr (subtype + 9, "__.rule") : NULL;
+        if (!end || end [7] != '\0')
+            continue;
+
+        bench_template_t item;
+        item.name.assign (entry->d_name, at - entry->d_name);
+        item.subtype.assign (subtype + 9, end - subtype - 9);
+        if (!s_bench_read_file (path + "/" + entry->d_name, item.json))
+            continue;
+        // gpio sensors are only bound to rules listing their model
+        rule_t *rule = rule_new ();
+        if (rule_parse (rule, s_bench_instance (item.json, "probe").c_str ()) == 0) {
+            const char *model = rule_model_first (rule);
+            item.model = model ? model : "";
+            templates.push_back (item);
+        }
+        else
+            log_error ("failed to parse template '%s'", entry->d_name);
+        rule_destroy (&rule);
+    }
+    closedir (dir);
+    std::sort (templates.begin (), templates.end (),
+        [] (const bench_template_t &a, const bench_template_t &b) { return a.name < b.name; });
+}
+
+//  Copy fixture rules and write template instances into dir, fills assets
+static bool
+s_bench_write_rules (const char *rules_dir, const char *dir, std::vector<bench_template_t> &templates,
+    int instances, std::vector<bench_asset_t> &assets)
+{
+    DIR *fixtures = opendir (rules_dir);
+    if (!fixtures) {
+        log_error ("cannot open dir '%s' (%s)", rules_dir, strerror (errno));
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir (fixtures)) != NULL) {
+        size_t l = strlen (entry->d_name);
+        std::string json;
+        if (l > 5 && streq (&(entry->d_name [l - 5]), ".rule") &&
+                s_bench_read_file (std::string (rules_dir) + "/" + entry->d_name, json))
+            s_bench_write_file (std::string (dir) + "/" + entry->d_name, json);
+    }
+    closedir (fixtures);
+
+    std::map<std::string, size_t> index;
+    for (auto &item : templates) {
+        std::string prefix = item.subtype;
+        if (!item.model.empty ())
+            prefix += "-" + item.model;
+        for (auto &c : prefix) {
+            if (!isalnum ((unsigned char) c) && c != '-') c = '-';
+        }
+        int count = item.subtype == "rackcontroller" ? 1 : instances;
+        for (int i = 1; i <= count; i++) {
+            std::string assetname = prefix + "-" + std::to_string (i);
+            if (index.find (assetname) == index.end ()) {
+                index [assetname] = assets.size ();
+                assets.push_back ({ assetname, item.subtype, item.model, {}, false });
+            }
+            std::string path = std::string (dir) + "/" + item.name + "@" + assetname + ".rule";
+            if (!s_bench_write_file (path, s_bench_instance (item.json, assetname.c_str ())))
+                return false;
+        }
+    }
+    return true;
+}
+
+int
+flexible_alert_bench (const char *rules_dir, const char *work_dir, int instances, int rounds, int changes, int workers, int batch)
+{
+    std::vector<bench_template_t> templates;
+    std::vector<bench_asset_t> assets;
+    s_bench_templates (rules_dir, templates);
+    std::string bench_rules = std::string (work_dir) + "/rules";
+    zsys_dir_create ("%s", bench_rules.c_str ());
+    if (!s_bench_write_rules (rules_dir, bench_rules.c_str (), templates, instances, assets))
+        return -1;
+
+    flexible_alert_t *self = flexible_alert_new ();
+    flexible_alert_set_eval_workers (self, workers);
+    self->alerts_batch = std::max (batch, 0);
+    self->alerts_batch_delay = 100;
+
+    int64_t start = zclock_usecs ();
+    flexible_alert_load_rules (self, bench_rules.c_str ());
+    flexible_alert_reindex (self);
+    int64_t load_us = zclock_usecs () - start;
+    if (zhash_size (self->rules) == 0) {
+        log_error ("no rule loaded from '%s'", bench_rules.c_str ());
+        flexible_alert_destroy (&self);
+        return -1;
+    }
+
+    start = zclock_usecs ();
+    for (auto &asset : assets) {
+        fty_proto_t *msg = fty_proto_new (FTY_PROTO_ASSET);
+        fty_proto_set_name (msg, "%s", asset.name.c_str ());
+        fty_proto_set_operation (msg, FTY_PROTO_ASSET_OP_UPDATE);
+        fty_proto_aux_insert (msg, FTY_PROTO_ASSET_AUX_TYPE, "device");
+        fty_proto_aux_insert (msg, FTY_PROTO_ASSET_AUX_SUBTYPE, "%s", asset.subtype.c_str ());
+        fty_proto_ext_insert (msg, "name", "%s", asset.name.c_str ());
+        if (!asset.model.empty ())
+            fty_proto_ext_insert (msg, FTY_PROTO_ASSET_EXT_MODEL, "%s", asset.model.c_str ());
+        if (asset.subtype == "ups")
+            fty_proto_ext_insert (msg, "group.1", "all-upses");
+        flexible_alert_handle_asset (self, msg);
+        fty_proto_destroy (&msg);
+    }
+    int64_t bind_us = zclock_usecs () - start;
+
+    // what SHM has to hold: every metric of rules bound to the asset
+    size_t bindings = 0, metrics = 0;
+    for (auto &asset : assets) {
+        zlist_t *names = (zlist_t *) zhash_lookup (self->assets, asset.name.c_str ());
+        if (!names) continue;
+        std::set<std::string> quantities;
+        const char *name = (const char *) zlist_first (names);
+        for (; name; name = (const char *) zlist_next (names)) {
+            rule_t *rule = (rule_t *) zhash_lookup (self->rules, name);
+            if (!rule) continue;
+            bindings++;
+            for (const char *metric = rule_metric_first (rule); metric; metric = rule_metric_next (rule))
+                quantities.insert (metric);
+        }
+        asset.metrics.assign (quantities.begin (), quantities.end ());
+        metrics += asset.metrics.size ();
+    }
+    self->shm_assets_pattern = strdup (".*");
+    self->shm_metrics_pattern = strdup (".*");
+    flexible_alert_shm_patterns (self);
+    long rss_loaded = s_bench_status_kb ("VmRSS");
+
+    zactor_t *server = zactor_new (mlm_server, (void *) "Malamute");
+    zstr_sendx (server, "BIND", BENCH_ENDPOINT, NULL);
+    mlm_client_connect (self->mlm, BENCH_ENDPOINT, 1000, "fty-alert-flexible-bench");
+    mlm_client_set_producer (self->mlm, FTY_PROTO_STREAM_ALERTS_SYS);
+    mlm_client_t *consumer = mlm_client_new ();
+    mlm_client_connect (consumer, BENCH_ENDPOINT, 1000, "fty-alert-flexible-bench-consumer");
+    mlm_client_set_consumer (consumer, FTY_PROTO_STREAM_ALERTS_SYS, ".*");
+
+    // alerts are received on their own thread, latency is taken on arrival.
+    // Only the receiver touches latencies until receiver.join (), which
+    // orders its writes before the reads below.
+    std::atomic<int64_t> poll_start (0);
+    std::atomic<uint64_t> received (0);
+    std::atomic<bool> stop (false);
+    std::vector<int64_t> latencies;
+    std::thread receiver ([&] () {
+        zpoller_t *poller = zpoller_new (mlm_client_msgpipe (consumer), NULL);
+        while (!stop) {
+            if (!zpoller_wait (poller, 100))
+                continue;
+            zmsg_t *msg = mlm_client_recv (consumer);
+            if (!msg)
+                break;
+            latencies.push_back (zclock_usecs () - poll_start);
+            zmsg_destroy (&msg);
+            received++;
+        }
+        zpoller_destroy (&poller);
+    });
+
+    zhashx_t *samples = zhashx_new ();
+    zhashx_set_destructor (samples, shm_sample_destroy);
+    uint64_t read = 0, skipped = 0, consumed = 0, evaluations = 0, published = 0, allocs = 0;
+    int64_t write_us = 0, poll_us = 0, eval_us = 0, first_us = 0;
+    size_t first_alerts = 0;
+    for (int round = 0; round <= rounds && !zsys_interrupted; round++) {
+        int64_t t0 = zclock_usecs ();
+        for (size_t i = 0; i < assets.size (); i++) {
+            bench_asset_t &asset = assets [i];
+            if (round > 0 && (int) ((i * 7919 + round * 13) % 100) < changes)
+                asset.alarm = !asset.alarm;
+            for (auto &metric : asset.metrics)
+                fty::shm::write_metric (asset.name, metric, s_bench_value (metric.c_str (), asset.alarm), "", BENCH_METRIC_TTL);
+        }
+
+        uint64_t handled = self->metrics_handled;
+        uint64_t evaluated = self->evaluations;
+        uint64_t sent = self->alerts_published;
+        int64_t t1 = zclock_usecs ();
+        poll_start = t1;
+        int unchanged = 0;
+        fty::shm::shmMetrics *result = shm_poll (samples, self->shm_assets_derived, self->shm_metrics_derived, round + 1, &unchanged);
+        size_t size = result->size ();
+        int64_t t2 = zclock_usecs ();
+        uint64_t allocated = s_bench_alloc_count ();
+        flexible_alert_handle_shm_batch (self, result);
+        allocated = s_bench_alloc_count () - allocated;
+        int64_t t3 = zclock_usecs ();
+
+        // next round starts when alerts of this one arrived
+        int64_t deadline = zclock_mono () + BENCH_ALERTS_TIMEOUT;
+        while (received < self->alerts_published && zclock_mono () < deadline)
+            zclock_sleep (1);
+
+        if (round == 0) {
+            first_us = t3 - t0;
+            first_alerts = received;
+            continue;
+        }
+        write_us += t1 - t0;
+        poll_us += t2 - t1;
+        eval_us += t3 - t2;
+        allocs += allocated;
+        read += size - unchanged;
+        skipped += unchanged;
+        consumed += self->metrics_handled - handled;
+        evaluations += self->evaluations - evaluated;
+        published += self->alerts_published - sent;
+    }
+    stop = true;
+    receiver.join ();
+    uint64_t lost = self->alerts_published - received;
+
+    std::vector<int64_t> sorted (latencies.begin () + std::min (first_alerts, latencies.size ()), latencies.end ());
+    std::sort (sorted.begin (), sorted.end ());
+    printf ("rules: %zu (%zu templates, %d instances), assets: %zu, bindings: %zu, SHM metrics: %zu\n",
+        zhash_size (self->rules), templates.size (), instances, assets.size (), bindings, metrics);
+    printf ("load: %.1f ms, bind: %.1f ms, first round: %.1f ms (%zu alerts)\n",
+        load_us / 1000.0, bind_us / 1000.0, first_us / 1000.0, first_alerts);
+    printf ("rounds: %d, changes: %d%%, workers: %d, batch: %d\n", rounds, changes, self->eval_workers, self->alerts_batch);
+    printf ("SHM write: %.0f metrics/s\n", s_bench_rate ((uint64_t) metrics * rounds, write_us));
+    printf ("SHM poll: %llu read, %llu unchanged, %.1f ms\n",
+        (unsigned long long) read, (unsigned long long) skipped, poll_us / 1000.0);
+    printf ("evaluation: %.0f metrics/s, %llu consumed, %llu evaluations, %.0f evaluations/s\n",
+        s_bench_rate (read, poll_us + eval_us), (unsigned long long) consumed,
+        (unsigned long long) evaluations, s_bench_rate (evaluations, eval_us));
+    printf ("allocations while evaluating: %llu, %.2f per consumed metric, %.1f per evaluation (all threads)\n",
+        (unsigned long long) allocs, consumed ? (double) allocs / consumed : 0.0,
+        evaluations ? (double) allocs / evaluations : 0.0);
+    printf ("alerts: %llu published, %llu suppressed, %llu lost\n",
+        (unsigned long long) published, (unsigned long long) self->alerts_suppressed, (unsigned long long) lost);
+    printf ("alert latency (us): p50 %lld, p90 %lld, p99 %lld, max %lld\n",
+        (long long) s_bench_percentile (sorted, 50), (long long) s_bench_percentile (sorted, 90),
+        (long long) s_bench_percentile (sorted, 99), (long long) (sorted.empty () ? 0 : sorted.back ()));
+    printf ("RSS: %ld kB loaded, %ld kB at end, %ld kB peak\n",
+        rss_loaded, s_bench_status_kb ("VmRSS"), s_bench_status_kb ("VmHWM"));
+
+    zhashx_destroy (&samples);
+    flexible_alert_destroy (&self);
+    mlm_client_destroy (&consumer);
+    zactor_destroy (&server);
+    return 0;
+}
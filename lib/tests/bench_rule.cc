@@ -0,0 +1,290 @@
+/*  ========================================================================
+    Copyright (C) 2020 Eaton
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    ========================================================================
+*/
+
+/*
+@header
+    bench_rule - micro-benchmarks of rule operations
+@discuss
+    Catch2 benchmarks of the test build, hidden from the default run:
+
+        fty-alert-flexible-test "[benchmark]" --benchmark-samples 20
+
+    Uses the rule API only, see rule.h.
+@end
+*/
+
+#include <catch2/catch.hpp>
+#include "../src/fty_alert_flexible_classes.h"
+#include <dirent.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+//  --------------------------------------------------------------------------
+//  Micro-benchmarks of rule hot paths over every rule of RULE_BENCH_RULES and
+//  a generated large rule. Every benchmark is named "<operation> <rule>".
+//  Compilation and evaluation are only benchmarked for rules which evaluate
+//  without error with every param set to "0".
+
+#define RULE_BENCH_RULES "selftest-ro/rules"
+#define RULE_BENCH_REPORT "selftest-rw/rule_bench.json"
+
+typedef struct {
+    rule_t *rule;
+    const char *json;
+    const char *params [RULE_MAX_PARAMS];
+    int count;
+} rule_bench_case_t;
+
+//  Size of json of every benchmarked rule, for the report
+static std::map<std::string, size_t> s_rule_bench_bytes;
+
+static int
+s_rule_bench_count (const char *locator, const char *value, void *data)
+{
+    (void) locator; (void) value;
+    (*(int *) data)++;
+    return 0;
+}
+
+static void
+s_rule_bench_vsjson_parse (rule_bench_case_t *c)
+{
+    int count = 0;
+    vsjson_parse (c->json, s_rule_bench_count, &count, true);
+}
+
+static void
+s_rule_bench_rule_parse (rule_bench_case_t *c)
+{
+    rule_t *rule = rule_new ();
+    rule_parse (rule, c->json);
+    rule_destroy (&rule);
+}
+
+static void
+s_rule_bench_rule_json (rule_bench_case_t *c)
+{
+    char *json = rule_json (c->rule);
+    zstr_free (&json);
+}
+
+static void
+s_rule_bench_rule_compile (rule_bench_case_t *c)
+{
+    rule_lua_release (c->rule);
+    rule_lua_key (c->rule);
+}
+
+static void
+s_rule_bench_rule_evaluate (rule_bench_case_t *c)
+{
+    int result;
+    const char *message;
+    rule_evaluate (c->rule, c->params, c->count, "bench-asset", "Bench Asset", &result, &message);
+}
+
+static const struct {
+    const char *name;
+    void (*fn) (rule_bench_case_t *);
+    bool evaluable;             // rule must evaluate without error
+} s_rule_bench_ops [] = {
+    { "vsjson_parse", s_rule_bench_vsjson_parse, false },
+    { "rule_parse", s_rule_bench_rule_parse, false },
+    { "rule_json", s_rule_bench_rule_json, false },
+    { "rule_compile", s_rule_bench_rule_compile, true },
+    { "rule_evaluate", s_rule_bench_rule_evaluate, true },
+};
+
+static void
+s_rule_bench_putf (std::string &json, const char *format, ...)
+{
+    char buffer [256];
+    va_list args;
+    va_start (args, format);
+    vsnprintf (buffer, sizeof (buffer), format, args);
+    va_end (args);
+    json.append (buffer);
+}
+
+//  Json of a rule with many metrics, variables and actions, whose evaluation
+//  calls a function per variable
+static std::string
+s_rule_bench_large_json (int metrics, int variables, int actions)
+{
+    const char *results [] = { "low_critical", "low_warning", "high_warning", "high_critical" };
+    std::string json;
+    json.append ("{\"name\": \"generated-large\", \"description\": \"generated rule\", \"metrics\": [");
+    for (int i = 0; i < metrics; i++)
+        s_rule_bench_putf (json, "%s\"bench.metric.%d\"", i ? ", " : "", i);
+    json.append ("], \"assets\": [");
+    for (int i = 0; i < 64; i++)
+        s_rule_bench_putf (json, "%s\"bench-asset-%d\"", i ? ", " : "", i);
+    json.append ("], \"groups\": [\"bench\"], \"models\": [\"bench\"], \"types\": [\"ups\", \"sts\"], \"results\": {");
+    for (int r = 0; r < 4; r++) {
+        s_rule_bench_putf (json, "%s\"%s\": {\"action\": [", r ? ", " : "", results [r]);
+        for (int i = 0; i < actions; i++) {
+            if (i % 2)
+                s_rule_bench_putf (json, "%s{\"action\": \"EMAIL\"}", i ? ", " : "");
+            else
+                s_rule_bench_putf (json, "%s{\"action\": \"GPO_INTERACTION\", \"asset\": \"gpo-%d\", \"mode\": \"open\"}", i ? ", " : "", i);
+        }
+        json.append ("]}");
+    }
+    json.append ("}, \"variables\": {");
+    for (int i = 0; i < variables; i++)
+        s_rule_bench_putf (json, "%s\"limit_%d\": \"%d\"", i ? ", " : "", i, i * 10);
+    json.append ("}, \"evaluation\": \"\\n");
+    for (int i = 0; i < variables; i++)
+        s_rule_bench_putf (json, "function check_%d (x)\\n    if x > tonumber (limit_%d) then return 1 end\\n    return 0\\nend\\n", i, i);
+    json.append (
+        "function main (...)\\n"
+        "    local sum, over = 0, 0\\n"
+        "    for i, v in ipairs ({...}) do\\n"
+        "        local x = tonumber (v) or 0\\n"
+        "        sum = sum + x\\n");
+    for (int i = 0; i < variables; i++)
+        s_rule_bench_putf (json, "        over = over + check_%d (x)\\n", i);
+    json.append (
+        "    end\\n"
+        "    if over > 0 then\\n"
+        "        return HIGH_WARNING, string.format ('%s has %d metrics over limit (sum %d)', NAME, over, sum)\\n"
+        "    end\\n"
+        "    return OK, string.format ('%s is fine (sum %d)', NAME, sum)\\n"
+        "end\\n\"}");
+    return json;
+}
+
+//  Rules of dir by file name without .rule, sorted
+static std::vector<std::pair<std::string, std::string>>
+s_rule_bench_read_dir (const char *path)
+{
+    std::vector<std::pair<std::string, std::string>> rules;
+    DIR *dir = opendir (path);
+    if (!dir) {
+        log_error ("cannot open dir '%s' (%s)", path, strerror (errno));
+        return rules;
+    }
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL) {
+        size_t l = strlen (entry->d_name);
+        if (l <= 5 || !streq (&(entry->d_name [l - 5]), ".rule"))
+            continue;
+        char *file = zsys_sprintf ("%s/%s", path, entry->d_name);
+        zfile_t *zfile = zfile_new (NULL, file);
+        zchunk_t *chunk = zfile && zfile_input (zfile) == 0 ? zfile_read (zfile, zfile_cursize (zfile), 0) : NULL;
+        if (chunk) {
+            char *json = zchunk_strdup (chunk);
+            rules.push_back ({ std::string (entry->d_name, l - 5), json });
+            zstr_free (&json);
+        }
+        else
+            log_error ("can't read file %s", file);
+        zchunk_destroy (&chunk);
+        zfile_destroy (&zfile);
+        zstr_free (&file);
+    }
+    closedir (dir);
+    std::sort (rules.begin (), rules.end ());
+    return rules;
+}
+
+TEST_CASE ("Rule micro-benchmarks", "[.][benchmark]")
+{
+    std::vector<std::pair<std::string, std::string>> rules = s_rule_bench_read_dir (RULE_BENCH_RULES);
+    REQUIRE (!rules.empty ());
+    rules.push_back ({ "generated-large", s_rule_bench_large_json (RULE_MAX_PARAMS / 2, 64, 16) });
+
+    for (auto &item : rules) {
+        rule_bench_case_t c;
+        memset (&c, 0, sizeof (c));
+        c.json = item.second.c_str ();
+        c.rule = rule_new ();
+        if (rule_parse (c.rule, c.json) != 0) {
+            WARN ("rule " << item.first << " can't be parsed, skipped");
+            rule_destroy (&c.rule);
+            continue;
+        }
+        s_rule_bench_bytes [item.first] = item.second.size ();
+        const char *metric = rule_metric_first (c.rule);
+        for (; metric && c.count < RULE_MAX_PARAMS; metric = rule_metric_next (c.rule))
+            c.params [c.count++] = "0";
+        int result = RULE_ERROR;
+        const char *message = NULL;
+        if (rule_lua_key (c.rule))
+            rule_evaluate (c.rule, c.params, c.count, "bench-asset", "Bench Asset", &result, &message);
+
+        for (auto &op : s_rule_bench_ops) {
+            if (op.evaluable && result == RULE_ERROR)
+                continue;
+            BENCHMARK (std::string (op.name) + " " + item.first) {
+                op.fn (&c);
+            };
+        }
+        rule_destroy (&c.rule);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Writes results of the benchmarks above to RULE_BENCH_REPORT when the run
+//  ends, to be compared between releases:
+//  { "lua": ..., "benchmarks": [{ "rule", "bytes", "operation", "samples",
+//  "iterations", "mean_ns", "mean_low_ns", "mean_high_ns", "stddev_ns" }, ...] }
+
+class RuleBenchReport : public Catch::TestEventListenerBase {
+public:
+    using Catch::TestEventListenerBase::TestEventListenerBase;
+
+    void benchmarkEnded (Catch::BenchmarkStats<> const &stats) override
+    {
+        const std::string &name = stats.info.name;
+        size_t space = name.find (' ');
+        if (space == std::string::npos)
+            return;
+        std::string rule = name.substr (space + 1);
+        // file names may hold anything, the name goes to json encoded
+        char *encoded = vsjson_encode_string (rule.c_str ());
+        s_rule_bench_putf (m_json, "%s\n    { \"rule\": %s, \"bytes\": %zu, \"operation\": \"%s\", "
+            "\"samples\": %zu, \"iterations\": %d, \"mean_ns\": %.1f, \"mean_low_ns\": %.1f, "
+            "\"mean_high_ns\": %.1f, \"stddev_ns\": %.1f }",
+            m_json.empty () ? "" : ",", encoded, s_rule_bench_bytes [rule], name.substr (0, space).c_str (),
+            stats.samples.size (), stats.info.iterations, stats.mean.point.count (),
+            stats.mean.lower_bound.count (), stats.mean.upper_bound.count (),
+            stats.standardDeviation.point.count ());
+        zstr_free (&encoded);
+    }
+
+    void testRunEnded (Catch::TestRunStats const &stats) override
+    {
+        Catch::TestEventListenerBase::testRunEnded (stats);
+        if (m_json.empty ())
+            return;
+        FILE *f = fopen (RULE_BENCH_REPORT, "w");
+        if (!f) {
+            log_error ("can't create file %s (%s)", RULE_BENCH_REPORT, strerror (errno));
+            return;
+        }
+        fprintf (f, "{\n  \"lua\": \"%s\",\n  \"benchmarks\": [%s\n  ]\n}\n", LUA_VERSION, m_json.c_str ());
+        fclose (f);
+    }
+
+private:
+    std::string m_json;
+};
+
+CATCH_REGISTER_LISTENER (RuleBenchReport)